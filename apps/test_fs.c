@@ -13,6 +13,22 @@
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 
+/* Number of blocks moved per fs_defrag() call */
+#define DEFRAG_SLICE 64
+
+/* Number of extents cat maps at once */
+#define CAT_EXTENTS 16
+
+/* Maximum number of tab-separated parts of a script line */
+#define SCRIPT_MAX_PARTS (FS_FILE_MAX_COUNT + 1)
+
+/*
+ * Maximum length of a script line: a command and as many file names (each with
+ * its tab separator) as a batch command takes, or a line of the original
+ * length limit
+ */
+#define SCRIPT_LINE_MAX (SCRIPT_MAX_PARTS * FS_FILENAME_LEN + 1024)
+
 #define test_fs_error(fmt, ...) \
 	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
 
@@ -41,12 +57,17 @@ void thread_fs_script(void *arg)
 	char *diskname, *script;
 	FILE *fd_script;
 	char *command, *data_source, *data_description, *data, *fs_filename;
-	const int total_command_parts = 4;
+	const int total_command_parts = SCRIPT_MAX_PARTS;
 	char *command_args[total_command_parts];
+	/* Status of each entry of a batch command */
+	int batch_status[FS_FILE_MAX_COUNT];
+	/* File descriptors opened by the last OPEN_MANY, closed along with fs_fd */
+	int batch_fds[FS_FILE_MAX_COUNT];
+	int batch_nfds = 0;
 	int offset;
 	char mounted = 0;
 
-	char line_buffer[1024];
+	char line_buffer[SCRIPT_LINE_MAX];
 	int command_index = 1;
 
 	if (t_arg->argc < 2)
@@ -63,20 +84,29 @@ void thread_fs_script(void *arg)
 	int fs_fd = -1;
 
 	/* Loop through the script and execute the specified commands */
-	while (fgets(line_buffer, 1024, fd_script) != NULL) {
+	while (fgets(line_buffer, sizeof(line_buffer), fd_script) != NULL) {
 		/* Remove trailing newline from command line */
 		char *nl = strchr(line_buffer, '\n');
 		if (nl)
 			*nl = '\0';
+		else if (!feof(fd_script)) {
+			/* Don't run what is left of the line as a command */
+			if (mounted)
+				fs_umount();
+			die("Script line too long");
+		}
 
 		/* Tokenize line */
 		command_args[0] = strtok(line_buffer, "\t");
-		command_index = 1;
-		do {
+		for (command_index = 1; command_index < total_command_parts; command_index++)
 			command_args[command_index] = strtok(NULL, "\t");
-		} while (command_index < total_command_parts && command_args[command_index++] != NULL);
 		command = command_args[0];
 
+		/* Number of arguments of a batch command */
+		int nargs = 0;
+		while (nargs < total_command_parts - 1 && command_args[nargs + 1])
+			nargs++;
+
 		int data_fd;
 		int count, data_size;
 
@@ -87,7 +117,15 @@ void thread_fs_script(void *arg)
 			break;
 
 		if (strcmp(command, "MOUNT") == 0) {
-			if (fs_mount(diskname))
+			int flags = 0;
+
+			if (command_args[1] && strcmp(command_args[1], "MMAP") == 0)
+				flags |= FS_MOUNT_MMAP;
+			else if (command_args[1] &&
+				 strcmp(command_args[1], "DIRECT") == 0)
+				flags |= FS_MOUNT_DIRECT;
+
+			if (fs_mount_flags(diskname, flags))
 				die("Cannot mount disk");
 			else {
 				printf("MOUNT successful.\n");
@@ -102,6 +140,14 @@ void thread_fs_script(void *arg)
 				mounted = 0;
 			}
 
+		} else if (strcmp(command, "SYNC") == 0) {
+			if (fs_sync()) {
+				fs_umount();
+				die("Cannot sync");
+			}
+
+			printf("SYNC successful.\n");
+
 		} else if (strcmp(command, "CREATE") == 0) {
 			fs_filename = command_args[1];
 
@@ -112,6 +158,17 @@ void thread_fs_script(void *arg)
 
 			printf("CREATE successful.\n");
 
+		} else if (strcmp(command, "CREATE_MANY") == 0) {
+			count = fs_create_many((const char **)&command_args[1],
+					       nargs, batch_status);
+			if (count != nargs) {
+				fs_umount();
+				die("Cannot create %d of %d files", nargs - count,
+				    nargs);
+			}
+
+			printf("CREATE_MANY successful (%d files).\n", count);
+
 		} else if (strcmp(command, "DELETE") == 0) {
 			fs_filename = command_args[1];
 
@@ -122,6 +179,17 @@ void thread_fs_script(void *arg)
 
 			printf("DELETE successful.\n");
 
+		} else if (strcmp(command, "DELETE_MANY") == 0) {
+			count = fs_delete_many((const char **)&command_args[1],
+					       nargs, batch_status);
+			if (count != nargs) {
+				fs_umount();
+				die("Cannot delete %d of %d files", nargs - count,
+				    nargs);
+			}
+
+			printf("DELETE_MANY successful (%d files).\n", count);
+
 		} else if (strcmp(command, "OPEN") == 0) {
 			fs_filename = command_args[1];
 
@@ -134,14 +202,56 @@ void thread_fs_script(void *arg)
 
 			printf("OPEN successful.\n");
 
+		} else if (strcmp(command, "OPEN_MANY") == 0) {
+			count = fs_open_many((const char **)&command_args[1],
+					     nargs, batch_fds);
+			batch_nfds = 0;
+			for (int i = 0; i < nargs; i++)
+				if (batch_fds[i] >= 0)
+					batch_fds[batch_nfds++] = batch_fds[i];
+
+			if (count != nargs) {
+				fs_umount();
+				die("Cannot open %d of %d files", nargs - count,
+				    nargs);
+			}
+
+			/* Later commands work on the first file */
+			if (batch_nfds)
+				fs_fd = batch_fds[0];
+			printf("OPEN_MANY successful (%d files).\n", count);
+
 		} else if (strcmp(command, "CLOSE") == 0) {
 			if (fs_close(fs_fd)) {
 				fs_umount();
 				die("Cannot close file");
 			}
+			for (int i = 0; i < batch_nfds; i++) {
+				if (batch_fds[i] != fs_fd && fs_close(batch_fds[i])) {
+					fs_umount();
+					die("Cannot close file");
+				}
+			}
+			batch_nfds = 0;
 
 			printf("CLOSE successful.\n");
 
+		} else if (strcmp(command, "TRUNCATE") == 0) {
+			if (fs_truncate(fs_fd, atoi(command_args[1]))) {
+				fs_umount();
+				die("Cannot truncate file");
+			}
+
+			printf("TRUNCATE successful.\n");
+
+		} else if (strcmp(command, "WRITE_BEHIND") == 0) {
+			if (fs_write_behind(fs_fd, 1)) {
+				fs_umount();
+				die("Cannot enable write-behind");
+			}
+
+			printf("WRITE_BEHIND successful.\n");
+
 		} else if (strcmp(command, "SEEK") == 0) {
 			offset = atoi(command_args[1]);
 
@@ -269,12 +379,42 @@ void thread_fs_script(void *arg)
 	fclose(fd_script);
 }
 
+static void print_io_stats(const char *name, const struct fs_io_stats *io)
+{
+	printf("%s: requests=%zu blocks=%zu errors=%zu\n", name, io->requests,
+	       io->blocks, io->errors);
+	for (int i = 0; i < FS_STATS_LAT_BUCKETS; i++) {
+		if (io->lat[i])
+			printf("\t[%lluns, %lluns): %zu\n", 1ULL << i,
+			       1ULL << (i + 1), io->lat[i]);
+	}
+}
+
+void thread_fs_stats(void *arg)
+{
+	struct fs_stats stats;
+
+	/* Run the workload, then report what it cost */
+	thread_fs_script(arg);
+
+	if (fs_stats(&stats))
+		die("Cannot get statistics");
+
+	printf("Stats:\n");
+	printf("reads=%zu bytes_read=%zu\n", stats.reads, stats.bytes_read);
+	printf("writes=%zu bytes_written=%zu rmw=%zu\n", stats.writes,
+	       stats.bytes_written, stats.rmw);
+	printf("cache_hits=%zu cache_misses=%zu\n", stats.cache_hits,
+	       stats.cache_misses);
+	print_io_stats("disk_reads", &stats.disk_reads);
+	print_io_stats("disk_writes", &stats.disk_writes);
+}
+
 void thread_fs_stat(void *arg)
 {
 	struct thread_arg *t_arg = arg;
 	char *diskname, *filename;
-	int fs_fd;
-	int stat;
+	struct fs_dirent dirent;
 
 	if (t_arg->argc < 2)
 		die("need <diskname> <filename>");
@@ -285,43 +425,31 @@ void thread_fs_stat(void *arg)
 	if (fs_mount(diskname))
 		die("Cannot mount diskname");
 
-	fs_fd = fs_open(filename);
-	if (fs_fd < 0) {
-		fs_umount();
-		die("Cannot open file");
-	}
-
-	stat = fs_stat(fs_fd);
-	if (stat < 0) {
-		fs_close(fs_fd);
+	if (fs_stat_name(filename, &dirent)) {
 		fs_umount();
 		die("Cannot stat file");
 	}
-	if (!stat) {
-		fs_close(fs_fd);
-		fs_umount();
+
+	if (fs_umount())
+		die("cannot unmount diskname");
+
+	if (!dirent.size) {
 		/* Nothing to read, file is empty */
 		printf("Empty file\n");
 		return;
 	}
 
-	if (fs_close(fs_fd)) {
-		fs_umount();
-		die("Cannot close file");
-	}
-
-	if (fs_umount())
-		die("cannot unmount diskname");
-
-	printf("Size of file '%s' is %d bytes\n", filename, stat);
+	printf("Size of file '%s' is %zu bytes\n", filename, dirent.size);
 }
 
 void thread_fs_cat(void *arg)
 {
 	struct thread_arg *t_arg = arg;
-	char *diskname, *filename, *buf;
+	char *diskname, *filename;
+	struct fs_extent extents[CAT_EXTENTS];
 	int fs_fd;
-	int stat, read;
+	int stat, read, n;
+	size_t offset;
 
 	if (t_arg->argc < 2)
 		die("need <diskname> <filename>");
@@ -329,7 +457,8 @@ void thread_fs_cat(void *arg)
 	diskname = t_arg->argv[0];
 	filename = t_arg->argv[1];
 
-	if (fs_mount(diskname))
+	/* Read-only access, write straight out of the mapped image */
+	if (fs_mount_flags(diskname, FS_MOUNT_MMAP))
 		die("Cannot mount diskname");
 
 	fs_fd = fs_open(filename);
@@ -348,14 +477,40 @@ void thread_fs_cat(void *arg)
 		printf("Empty file\n");
 		return;
 	}
-	buf = malloc(stat);
-	if (!buf) {
-		perror("malloc");
+
+	/* Mapping copies nothing, so count the bytes first for the header */
+	read = 0;
+	while ((n = fs_map(fs_fd, read, stat - read, extents,
+			   CAT_EXTENTS)) > 0) {
+		for (int i = 0; i < n; i++)
+			read += extents[i].len;
+		fs_unmap(fs_fd, extents, n);
+	}
+	if (n < 0) {
+		fs_close(fs_fd);
 		fs_umount();
-		die("Cannot malloc");
+		die("Cannot map file");
+	}
+
+	printf("Read file '%s' (%d/%d bytes)\n", filename, read, stat);
+	printf("Content of the file:\n");
+	offset = 0;
+	while (offset < (size_t)read &&
+	       (n = fs_map(fs_fd, offset, read - offset, extents,
+			   CAT_EXTENTS)) > 0) {
+		for (int i = 0; i < n; i++) {
+			fwrite(extents[i].data, 1, extents[i].len, stdout);
+			offset += extents[i].len;
+		}
+		fs_unmap(fs_fd, extents, n);
 	}
+	fflush(stdout);
 
-	read = fs_read(fs_fd, buf, stat);
+	if (n < 0) {
+		fs_close(fs_fd);
+		fs_umount();
+		die("Cannot map file");
+	}
 
 	if (fs_close(fs_fd)) {
 		fs_umount();
@@ -364,13 +519,6 @@ void thread_fs_cat(void *arg)
 
 	if (fs_umount())
 		die("cannot unmount diskname");
-
-	printf("Read file '%s' (%d/%d bytes)\n", filename, read, stat);
-	printf("Content of the file:\n");
-	fwrite(buf, 1, stat, stdout);
-	fflush(stdout);
-
-	free(buf);
 }
 
 void thread_fs_rm(void *arg)
@@ -444,6 +592,10 @@ void thread_fs_add(void *arg)
 		die("Cannot open file");
 	}
 
+	/* Reserve contiguous blocks up front; if the disk is too small, the
+	 * write still goes as far as it can */
+	fs_fallocate(fs_fd, st.st_size);
+
 	written = fs_write(fs_fd, buf, st.st_size);
 
 	if (fs_close(fs_fd)) {
@@ -461,6 +613,39 @@ void thread_fs_add(void *arg)
 	close(fd);
 }
 
+void thread_fs_defrag(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	int ret;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	diskname = t_arg->argv[0];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	printf("Before:\n");
+	fs_frag_ls();
+
+	/* Work in bounded slices, as an online defragmenter would */
+	do {
+		ret = fs_defrag(DEFRAG_SLICE);
+	} while (ret == 1);
+	if (ret < 0) {
+		fs_umount();
+		die("Cannot defragment");
+	}
+
+	printf("After:\n");
+	fs_frag_ls();
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
 void thread_fs_ls(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -517,7 +702,9 @@ static struct {
 	{ "rm",		thread_fs_rm },
 	{ "cat",	thread_fs_cat },
 	{ "stat",	thread_fs_stat },
-	{ "script",	thread_fs_script }
+	{ "defrag",	thread_fs_defrag },
+	{ "script",	thread_fs_script },
+	{ "stats",	thread_fs_stats }
 };
 
 void usage(char *program)
@@ -284,6 +284,70 @@ END_SCRIPT
     log "Score: ${score}"
 }
 
+#
+# Extensions
+#
+
+# Compare the output of the last test to an expected output of scripts/
+compare_expected() {
+    # 1: expected output name
+    local line_array=()
+    local corr_array=()
+    mapfile -t line_array <<< "${STDOUT}"
+    mapfile -t corr_array < "scripts/${1}.expected"
+    # Missing lines count as wrong ones
+    while [[ ${#line_array[@]} -lt ${#corr_array[@]} ]]; do
+        line_array+=("")
+    done
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+# Run a script of scripts/ on a new disk and compare its output to the
+# expected one
+run_script() {
+    # 1: script name
+    # 2: number of data blocks of the disk
+    run_tool ./fs_make.x test.fs "${2}"
+    run_test ./test_fs.x script test.fs "scripts/${1}.script"
+    rm -f test.fs
+
+    compare_expected "${1}"
+}
+
+# small writes gathered by the write-behind buffer
+write_behind() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+    run_script write_behind 100
+}
+
+# shrink and extend a file open twice
+truncate_file() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+    head -c 4096 /dev/zero > zero_file
+    run_script truncate 100
+    rm -f zero_file
+}
+
+# defragment a file interleaved with others, in several slices
+defrag() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+    run_tool dd if=/dev/urandom of=defrag_file bs=4096 count=80
+    run_tool ./fs_make.x test.fs 200
+    run_test ./test_fs.x script test.fs scripts/fragment.script
+    compare_expected fragment
+    run_test ./test_fs.x defrag test.fs
+    compare_expected defrag
+    run_test ./test_fs.x script test.fs scripts/defrag_check.script
+    compare_expected defrag_check
+    rm -f test.fs defrag_file
+}
+
 #
 # Run tests
 #
@@ -296,6 +360,10 @@ run_tests() {
     # Phase 3+4
     read_block
     overwrite_block
+    # Extensions
+    write_behind
+    truncate_file
+    defrag
 }
 
 make_fs() {
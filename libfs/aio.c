@@ -0,0 +1,417 @@
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aio.h"
+
+#define aio_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* Maximum number of threads of the fallback engine */
+#define AIO_MAX_THREADS 8
+
+/* io_uring instance description */
+struct uring {
+	int fd;
+	/* Submission queue */
+	void *sq_ring;
+	size_t sq_ring_size;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	/* Completion queue (may share the submission queue mapping) */
+	void *cq_ring;
+	size_t cq_ring_size;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	/* Queued but not yet handed to the kernel */
+	unsigned to_submit;
+};
+
+/* Thread pool description */
+struct pool {
+	pthread_t threads[AIO_MAX_THREADS];
+	int nthreads;
+	pthread_mutex_t lock;
+	pthread_cond_t work, done;
+	int stop;
+	/* FIFO of queued requests */
+	struct aio_req *queued[AIO_MAX_DEPTH];
+	unsigned qhead, qcount;
+	/* FIFO of completed requests */
+	struct aio_req *completed[AIO_MAX_DEPTH];
+	unsigned chead, ccount;
+};
+
+/* Asynchronous I/O engine instance description */
+struct aio {
+	enum aio_engine engine;
+	unsigned depth;
+	unsigned inflight;
+	struct uring ring;
+	struct pool pool;
+};
+
+/*
+ * io_uring engine
+ */
+
+static int uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+		       unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+		       NULL, 0);
+}
+
+static void uring_unmap(struct uring *r)
+{
+	if (r->sqes)
+		munmap(r->sqes, r->sqes_size);
+	if (r->cq_ring && r->cq_ring != r->sq_ring)
+		munmap(r->cq_ring, r->cq_ring_size);
+	if (r->sq_ring)
+		munmap(r->sq_ring, r->sq_ring_size);
+	close(r->fd);
+}
+
+static int uring_start(struct uring *r, unsigned depth)
+{
+	struct io_uring_params p;
+
+	memset(r, 0, sizeof(*r));
+	memset(&p, 0, sizeof(p));
+	if ((r->fd = uring_setup(depth, &p)) < 0)
+		return -1;
+
+	r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_ring_size = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_ring_size > r->sq_ring_size)
+			r->sq_ring_size = r->cq_ring_size;
+		r->cq_ring_size = r->sq_ring_size;
+	}
+
+	r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ring == MAP_FAILED) {
+		r->sq_ring = NULL;
+		uring_unmap(r);
+		return -1;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->cq_ring = r->sq_ring;
+	} else {
+		r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+				  MAP_SHARED | MAP_POPULATE, r->fd,
+				  IORING_OFF_CQ_RING);
+		if (r->cq_ring == MAP_FAILED) {
+			r->cq_ring = NULL;
+			uring_unmap(r);
+			return -1;
+		}
+	}
+
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		r->sqes = NULL;
+		uring_unmap(r);
+		return -1;
+	}
+
+	r->sq_head = (unsigned *)((char *)r->sq_ring + p.sq_off.head);
+	r->sq_tail = (unsigned *)((char *)r->sq_ring + p.sq_off.tail);
+	r->sq_mask = (unsigned *)((char *)r->sq_ring + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)((char *)r->sq_ring + p.sq_off.array);
+	r->cq_head = (unsigned *)((char *)r->cq_ring + p.cq_off.head);
+	r->cq_tail = (unsigned *)((char *)r->cq_ring + p.cq_off.tail);
+	r->cq_mask = (unsigned *)((char *)r->cq_ring + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)((char *)r->cq_ring + p.cq_off.cqes);
+
+	return 0;
+}
+
+static void uring_submit(struct uring *r, struct aio_req *req)
+{
+	unsigned tail = *r->sq_tail;
+	unsigned idx = tail & *r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = req->write ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->fd = req->fd;
+	sqe->off = req->offset;
+	sqe->addr = (uintptr_t)req->iov;
+	sqe->len = req->iovcnt;
+	sqe->user_data = (uintptr_t)req;
+
+	r->sq_array[idx] = idx;
+	/* Publish the entry before the new tail */
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	r->to_submit++;
+}
+
+static struct aio_req *uring_reap(struct uring *r)
+{
+	unsigned head;
+
+	for (;;) {
+		head = *r->cq_head;
+		if (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+			break;
+
+		/* Hand queued entries over and wait for a completion */
+		int ret = uring_enter(r->fd, r->to_submit, 1,
+				      IORING_ENTER_GETEVENTS);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("io_uring_enter");
+			return NULL;
+		}
+		r->to_submit -= ret;
+	}
+
+	struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+	struct aio_req *req = (struct aio_req *)(uintptr_t)cqe->user_data;
+
+	req->result = cqe->res;
+	__atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+
+	return req;
+}
+
+/*
+ * Wait until the kernel is done with @inflight requests, even if
+ * io_uring_enter() keeps failing: entries not handed over yet are withdrawn,
+ * and completions, which the kernel posts to the ring on its own, are picked
+ * off it in between attempts
+ */
+static void uring_drain(struct uring *r, unsigned inflight)
+{
+	const struct timespec retry = { 0, 1000000 };
+
+	if (r->to_submit) {
+		__atomic_store_n(r->sq_tail, *r->sq_tail - r->to_submit,
+				 __ATOMIC_RELEASE);
+		inflight -= r->to_submit;
+		r->to_submit = 0;
+	}
+
+	while (inflight) {
+		unsigned head = *r->cq_head;
+
+		if (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+			__atomic_store_n(r->cq_head, head + 1,
+					 __ATOMIC_RELEASE);
+			inflight--;
+			continue;
+		}
+
+		if (uring_enter(r->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+		    errno != EINTR)
+			nanosleep(&retry, NULL);
+	}
+}
+
+/*
+ * Thread pool engine
+ */
+
+static void *pool_worker(void *arg)
+{
+	struct pool *p = arg;
+
+	pthread_mutex_lock(&p->lock);
+	for (;;) {
+		while (!p->stop && !p->qcount)
+			pthread_cond_wait(&p->work, &p->lock);
+		if (!p->qcount)
+			break;
+
+		struct aio_req *req = p->queued[p->qhead];
+		p->qhead = (p->qhead + 1) % AIO_MAX_DEPTH;
+		p->qcount--;
+		pthread_mutex_unlock(&p->lock);
+
+		ssize_t ret;
+		if (req->write)
+			ret = pwritev(req->fd, req->iov, req->iovcnt,
+				      req->offset);
+		else
+			ret = preadv(req->fd, req->iov, req->iovcnt,
+				     req->offset);
+		req->result = ret < 0 ? -errno : ret;
+
+		pthread_mutex_lock(&p->lock);
+		p->completed[(p->chead + p->ccount) % AIO_MAX_DEPTH] = req;
+		p->ccount++;
+		pthread_cond_signal(&p->done);
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	return NULL;
+}
+
+static void pool_stop(struct pool *p)
+{
+
+	pthread_mutex_lock(&p->lock);
+	p->stop = 1;
+	pthread_cond_broadcast(&p->work);
+	pthread_mutex_unlock(&p->lock);
+
+	for (int i = 0; i < p->nthreads; i++)
+		pthread_join(p->threads[i], NULL);
+
+	pthread_cond_destroy(&p->done);
+	pthread_cond_destroy(&p->work);
+	pthread_mutex_destroy(&p->lock);
+}
+
+static int pool_start(struct pool *p, unsigned depth)
+{
+
+	memset(p, 0, sizeof(*p));
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->work, NULL);
+	pthread_cond_init(&p->done, NULL);
+
+	while (p->nthreads < AIO_MAX_THREADS && p->nthreads < (int)depth) {
+		if (pthread_create(&p->threads[p->nthreads], NULL, pool_worker,
+				   p))
+			break;
+		p->nthreads++;
+	}
+
+	if (!p->nthreads) {
+		pool_stop(p);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void pool_submit(struct pool *p, struct aio_req *req)
+{
+
+	pthread_mutex_lock(&p->lock);
+	p->queued[(p->qhead + p->qcount) % AIO_MAX_DEPTH] = req;
+	p->qcount++;
+	pthread_cond_signal(&p->work);
+	pthread_mutex_unlock(&p->lock);
+}
+
+static struct aio_req *pool_reap(struct pool *p)
+{
+	struct aio_req *req;
+
+	pthread_mutex_lock(&p->lock);
+	while (!p->ccount)
+		pthread_cond_wait(&p->done, &p->lock);
+	req = p->completed[p->chead];
+	p->chead = (p->chead + 1) % AIO_MAX_DEPTH;
+	p->ccount--;
+	pthread_mutex_unlock(&p->lock);
+
+	return req;
+}
+
+/*
+ * Engine-independent interface
+ */
+
+struct aio *aio_start(unsigned depth, enum aio_engine engine)
+{
+	struct aio *aio = calloc(1, sizeof(*aio));
+
+	if (!aio) {
+		aio_error("cannot allocate engine");
+		return NULL;
+	}
+
+	if (!depth)
+		depth = 1;
+	if (depth > AIO_MAX_DEPTH)
+		depth = AIO_MAX_DEPTH;
+
+	if (engine == AIO_URING && !uring_start(&aio->ring, depth)) {
+		aio->engine = AIO_URING;
+	} else if (!pool_start(&aio->pool, depth)) {
+		aio->engine = AIO_THREADS;
+	} else {
+		aio_error("cannot start any engine");
+		free(aio);
+		return NULL;
+	}
+
+	aio->depth = depth;
+
+	return aio;
+}
+
+void aio_stop(struct aio *aio)
+{
+	if (aio->engine == AIO_URING) {
+		uring_drain(&aio->ring, aio->inflight);
+		uring_unmap(&aio->ring);
+	} else {
+		/* Workers only exit once the queue is empty */
+		pool_stop(&aio->pool);
+	}
+
+	free(aio);
+}
+
+unsigned aio_depth(const struct aio *aio)
+{
+	return aio ? aio->depth : 0;
+}
+
+int aio_submit(struct aio *aio, struct aio_req *req)
+{
+	if (aio->inflight == aio->depth)
+		return -1;
+
+	if (aio->engine == AIO_URING)
+		uring_submit(&aio->ring, req);
+	else
+		pool_submit(&aio->pool, req);
+	aio->inflight++;
+
+	return 0;
+}
+
+struct aio_req *aio_reap(struct aio *aio)
+{
+	struct aio_req *req;
+
+	if (!aio->inflight)
+		return NULL;
+
+	if (aio->engine == AIO_URING)
+		req = uring_reap(&aio->ring);
+	else
+		req = pool_reap(&aio->pool);
+
+	if (req)
+		aio->inflight--;
+
+	return req;
+}
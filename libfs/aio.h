@@ -0,0 +1,86 @@
+#ifndef _AIO_H
+#define _AIO_H
+
+#include <sys/types.h> /* for off_t/ssize_t definitions */
+#include <sys/uio.h> /* for struct iovec definition */
+
+/** Maximum number of requests in flight */
+#define AIO_MAX_DEPTH 64
+
+/** Asynchronous I/O engine instance */
+struct aio;
+
+/** Asynchronous I/O engines */
+enum aio_engine {
+	AIO_URING,	/* Linux io_uring */
+	AIO_THREADS,	/* Pool of threads doing blocking system calls */
+};
+
+/** Positional vectored transfer */
+struct aio_req {
+	/* File descriptor to transfer from/to */
+	int fd;
+	/* Write if set, read otherwise */
+	int write;
+	/* File offset of the transfer */
+	off_t offset;
+	/* Buffers */
+	const struct iovec *iov;
+	int iovcnt;
+	/* Number of bytes transferred, or -errno, once completed */
+	ssize_t result;
+};
+
+/**
+ * aio_start - Start an asynchronous I/O engine
+ * @depth: Maximum number of requests in flight (capped to %AIO_MAX_DEPTH)
+ * @engine: %AIO_URING to try io_uring first, %AIO_THREADS to use the thread
+ * pool directly
+ *
+ * If io_uring is not available, the thread pool is used instead. An engine
+ * must only be used by one thread at a time.
+ *
+ * Return: NULL if the engine cannot be started. Otherwise, the new engine.
+ */
+struct aio *aio_start(unsigned depth, enum aio_engine engine);
+
+/**
+ * aio_stop - Stop an asynchronous I/O engine
+ * @aio: Engine
+ *
+ * Requests still in flight are waited for, even if aio_reap() failed, so that
+ * none of them touches its buffers once this returns; requests queued but not
+ * started yet may be dropped instead. Their results are discarded.
+ */
+void aio_stop(struct aio *aio);
+
+/**
+ * aio_depth - Get the queue depth of an engine
+ * @aio: Engine, or NULL
+ *
+ * Return: 0 if @aio is NULL, the maximum number of requests in flight
+ * otherwise.
+ */
+unsigned aio_depth(const struct aio *aio);
+
+/**
+ * aio_submit - Queue a request
+ * @aio: Engine
+ * @req: Request, which must stay valid until it is reaped
+ *
+ * Queued requests are started at the latest by the next aio_reap().
+ *
+ * Return: -1 if aio_depth() requests are already in flight. 0 otherwise.
+ */
+int aio_submit(struct aio *aio, struct aio_req *req);
+
+/**
+ * aio_reap - Wait for a request to complete
+ * @aio: Engine
+ *
+ * Return: NULL if no request is in flight. Otherwise, a completed request with
+ * its result filled in.
+ */
+struct aio_req *aio_reap(struct aio *aio);
+
+#endif /* _AIO_H */
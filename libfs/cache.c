@@ -0,0 +1,502 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "disk.h"
+
+#define cache_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* Slot or block that is not in the cache */
+#define NO_SLOT -1
+
+/* Maximum number of blocks handed to the disk layer at once */
+#define CACHE_BATCH 64
+
+/* Write everything back once this fraction of the slots is dirty */
+#define DIRTY_HIGH_NUM 3
+#define DIRTY_HIGH_DEN 4
+
+/* Cached block description */
+struct cache_slot {
+	/* Disk block held by this slot, or NO_SLOT if the slot is free */
+	long block;
+	/* Block content differs from disk */
+	int dirty;
+	/* CLOCK reference bit */
+	int ref;
+	/* Number of cache_pin() calls not released yet, eviction skips the slot */
+	int pins;
+	/* LRU list links, most recently used first */
+	int prev, next;
+};
+
+/* Block cache instance description */
+struct cache {
+	/* Set up by cache_init() */
+	int active;
+	enum cache_policy policy;
+	/* Number of slots and slot array */
+	size_t nslots;
+	struct cache_slot *slots;
+	/* Slot contents, nslots * BLOCK_SIZE bytes */
+	char *data;
+	/* Slot holding each disk block, or NO_SLOT */
+	int *slot_of;
+	size_t nblocks;
+	/* Number of dirty slots */
+	size_t ndirty;
+	/* Number of pinned slots, at most half of them */
+	size_t npinned;
+	/* CLOCK hand */
+	size_t hand;
+	/* LRU list ends */
+	int head, tail;
+};
+
+static struct cache cache;
+
+static size_t cache_hits, cache_misses;
+
+static inline char *slot_data(int s)
+{
+	return cache.data + (size_t)s * BLOCK_SIZE;
+}
+
+static void lru_unlink(int s)
+{
+	struct cache_slot *slot = &cache.slots[s];
+
+	if (slot->prev != NO_SLOT)
+		cache.slots[slot->prev].next = slot->next;
+	else
+		cache.head = slot->next;
+	if (slot->next != NO_SLOT)
+		cache.slots[slot->next].prev = slot->prev;
+	else
+		cache.tail = slot->prev;
+}
+
+static void lru_push_front(int s)
+{
+	struct cache_slot *slot = &cache.slots[s];
+
+	slot->prev = NO_SLOT;
+	slot->next = cache.head;
+	if (cache.head != NO_SLOT)
+		cache.slots[cache.head].prev = s;
+	cache.head = s;
+	if (cache.tail == NO_SLOT)
+		cache.tail = s;
+}
+
+/* Record an access to slot @s for the eviction policy */
+static void slot_touch(int s)
+{
+	if (cache.policy == CACHE_LRU) {
+		lru_unlink(s);
+		lru_push_front(s);
+	} else {
+		cache.slots[s].ref = 1;
+	}
+}
+
+static int slot_writeback(int s)
+{
+	struct cache_slot *slot = &cache.slots[s];
+
+	if (!slot->dirty)
+		return 0;
+	if (block_write(slot->block, slot_data(s)))
+		return -1;
+	slot->dirty = 0;
+	cache.ndirty--;
+	return 0;
+}
+
+/* Pick the slot to reuse, writing its content back if needed */
+static int slot_evict(void)
+{
+	int s;
+
+	/* Pinned slots are skipped; there is always an unpinned one */
+	if (cache.policy == CACHE_LRU) {
+		s = cache.tail;
+		while (cache.slots[s].pins)
+			s = cache.slots[s].prev;
+	} else {
+		/* Give referenced slots a second chance */
+		while (cache.slots[cache.hand].block != NO_SLOT &&
+		       (cache.slots[cache.hand].ref ||
+			cache.slots[cache.hand].pins)) {
+			cache.slots[cache.hand].ref = 0;
+			cache.hand = (cache.hand + 1) % cache.nslots;
+		}
+		s = cache.hand;
+		cache.hand = (cache.hand + 1) % cache.nslots;
+	}
+
+	if (cache.slots[s].block != NO_SLOT) {
+		if (slot_writeback(s))
+			return NO_SLOT;
+		cache.slot_of[cache.slots[s].block] = NO_SLOT;
+		cache.slots[s].block = NO_SLOT;
+	}
+
+	return s;
+}
+
+/* Attach @block to a slot, evicting another block if necessary */
+static int slot_get(size_t block)
+{
+	int s = slot_evict();
+
+	if (s == NO_SLOT)
+		return NO_SLOT;
+
+	cache.slots[s].block = block;
+	cache.slots[s].dirty = 0;
+	cache.slot_of[block] = s;
+	slot_touch(s);
+
+	return s;
+}
+
+int cache_init(size_t nblocks, enum cache_policy policy)
+{
+	int count;
+
+	if (cache.active) {
+		cache_error("cache already set up");
+		return -1;
+	}
+
+	if ((count = block_disk_count()) < 0)
+		return -1;
+
+	memset(&cache, 0, sizeof(cache));
+	cache.policy = policy;
+	cache.nslots = nblocks;
+	cache.nblocks = count;
+	cache.head = cache.tail = NO_SLOT;
+
+	if (nblocks) {
+		/* Block-aligned, so that slots can be used for direct I/O */
+		if (posix_memalign((void **)&cache.data, BLOCK_SIZE,
+				   nblocks * BLOCK_SIZE))
+			cache.data = NULL;
+		cache.slots = malloc(nblocks * sizeof(*cache.slots));
+		cache.slot_of = malloc(cache.nblocks * sizeof(*cache.slot_of));
+		if (!cache.slots || !cache.data || !cache.slot_of) {
+			free(cache.slots);
+			free(cache.data);
+			free(cache.slot_of);
+			cache_error("cannot allocate %zu blocks", nblocks);
+			return -1;
+		}
+
+		for (size_t i = 0; i < cache.nblocks; i++)
+			cache.slot_of[i] = NO_SLOT;
+		for (size_t i = 0; i < nblocks; i++) {
+			cache.slots[i].block = NO_SLOT;
+			cache.slots[i].dirty = 0;
+			cache.slots[i].ref = 0;
+			cache.slots[i].pins = 0;
+			cache.slots[i].prev = cache.slots[i].next = NO_SLOT;
+			if (policy == CACHE_LRU)
+				lru_push_front(i);
+		}
+	}
+
+	cache.active = 1;
+
+	return 0;
+}
+
+int cache_destroy(void)
+{
+	if (!cache.active) {
+		cache_error("cache not set up");
+		return -1;
+	}
+
+	if (cache_flush())
+		return -1;
+
+	free(cache.slots);
+	free(cache.data);
+	free(cache.slot_of);
+	memset(&cache, 0, sizeof(cache));
+
+	return 0;
+}
+
+int cache_read(size_t block, void *buf)
+{
+	int s;
+
+	if (!cache.nslots)
+		return block_read(block, buf);
+
+	if (block >= cache.nblocks)
+		return block_read(block, buf);
+
+	if ((s = cache.slot_of[block]) != NO_SLOT) {
+		cache_hits++;
+		slot_touch(s);
+		memcpy(buf, slot_data(s), BLOCK_SIZE);
+		return 0;
+	}
+
+	cache_misses++;
+	if ((s = slot_get(block)) == NO_SLOT)
+		return -1;
+
+	if (block_read(block, slot_data(s))) {
+		cache.slot_of[block] = NO_SLOT;
+		cache.slots[s].block = NO_SLOT;
+		return -1;
+	}
+	memcpy(buf, slot_data(s), BLOCK_SIZE);
+
+	return 0;
+}
+
+int cache_write(size_t block, const void *buf)
+{
+	int s;
+
+	if (!cache.nslots)
+		return block_write(block, buf);
+
+	if (block >= cache.nblocks)
+		return block_write(block, buf);
+
+	if ((s = cache.slot_of[block]) != NO_SLOT) {
+		cache_hits++;
+		slot_touch(s);
+	} else {
+		cache_misses++;
+		if ((s = slot_get(block)) == NO_SLOT)
+			return -1;
+	}
+
+	memcpy(slot_data(s), buf, BLOCK_SIZE);
+	if (!cache.slots[s].dirty) {
+		cache.slots[s].dirty = 1;
+		cache.ndirty++;
+	}
+
+	/* Memory pressure: don't let dirty data pile up in the cache */
+	if (cache.ndirty * DIRTY_HIGH_DEN >= cache.nslots * DIRTY_HIGH_NUM)
+		return cache_flush();
+
+	return 0;
+}
+
+int cache_readv(const size_t *blocks, void *const *bufs, size_t count)
+{
+	size_t miss_blocks[CACHE_BATCH];
+	void *miss_bufs[CACHE_BATCH];
+	size_t nmiss = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		int s = NO_SLOT;
+
+		if (cache.nslots && blocks[i] < cache.nblocks)
+			s = cache.slot_of[blocks[i]];
+
+		if (s != NO_SLOT) {
+			cache_hits++;
+			slot_touch(s);
+			memcpy(bufs[i], slot_data(s), BLOCK_SIZE);
+			continue;
+		}
+
+		if (cache.nslots)
+			cache_misses++;
+		miss_blocks[nmiss] = blocks[i];
+		miss_bufs[nmiss] = bufs[i];
+		if (++nmiss == CACHE_BATCH) {
+			if (block_readv(miss_blocks, miss_bufs, nmiss))
+				return -1;
+			nmiss = 0;
+		}
+	}
+
+	return nmiss ? block_readv(miss_blocks, miss_bufs, nmiss) : 0;
+}
+
+int cache_writev(const size_t *blocks, const void *const *bufs, size_t count)
+{
+	for (size_t i = 0; cache.nslots && i < count; i++) {
+		int s;
+
+		if (blocks[i] >= cache.nblocks)
+			continue;
+		if ((s = cache.slot_of[blocks[i]]) == NO_SLOT) {
+			cache_misses++;
+			continue;
+		}
+
+		/* The cached copy is about to match the disk again */
+		cache_hits++;
+		memcpy(slot_data(s), bufs[i], BLOCK_SIZE);
+		if (cache.slots[s].dirty) {
+			cache.slots[s].dirty = 0;
+			cache.ndirty--;
+		}
+	}
+
+	return block_writev(blocks, bufs, count);
+}
+
+int cache_prefetch(const size_t *blocks, size_t count)
+{
+	size_t load_blocks[CACHE_BATCH];
+	void *load_bufs[CACHE_BATCH];
+	int load_slots[CACHE_BATCH];
+	size_t n = 0;
+
+	if (count > cache.nslots / 2)
+		count = cache.nslots / 2;
+	if (count > CACHE_BATCH)
+		count = CACHE_BATCH;
+
+	size_t i;
+	for (i = 0; i < count; i++) {
+		int s;
+
+		if (blocks[i] >= cache.nblocks)
+			break;
+		if (cache.slot_of[blocks[i]] != NO_SLOT)
+			continue;
+		if ((s = slot_get(blocks[i])) == NO_SLOT)
+			break;
+
+		load_blocks[n] = blocks[i];
+		load_bufs[n] = slot_data(s);
+		load_slots[n] = s;
+		n++;
+	}
+
+	if (n && block_readv(load_blocks, load_bufs, n)) {
+		/* Don't leave garbage behind in the slots */
+		for (size_t i = 0; i < n; i++) {
+			cache.slot_of[load_blocks[i]] = NO_SLOT;
+			cache.slots[load_slots[i]].block = NO_SLOT;
+		}
+		return -1;
+	}
+
+	return i;
+}
+
+void *cache_pin(size_t block)
+{
+	int s;
+
+	if (!cache.nslots || block >= cache.nblocks)
+		return NULL;
+
+	if ((s = cache.slot_of[block]) != NO_SLOT) {
+		cache_hits++;
+		slot_touch(s);
+	} else {
+		if (cache.npinned + 1 > cache.nslots / 2)
+			return NULL;
+		cache_misses++;
+		if ((s = slot_get(block)) == NO_SLOT)
+			return NULL;
+		if (block_read(block, slot_data(s))) {
+			cache.slot_of[block] = NO_SLOT;
+			cache.slots[s].block = NO_SLOT;
+			return NULL;
+		}
+	}
+
+	if (!cache.slots[s].pins) {
+		if (cache.npinned + 1 > cache.nslots / 2)
+			return NULL;
+		cache.npinned++;
+	}
+	cache.slots[s].pins++;
+
+	return slot_data(s);
+}
+
+void cache_unpin(const void *data)
+{
+	const char *p = data;
+	size_t s;
+
+	if (!cache.nslots || p < cache.data ||
+	    p >= cache.data + cache.nslots * BLOCK_SIZE ||
+	    !cache.slots[s = (p - cache.data) / BLOCK_SIZE].pins) {
+		cache_error("block not pinned");
+		return;
+	}
+
+	if (!--cache.slots[s].pins)
+		cache.npinned--;
+}
+
+int cache_contains(size_t block)
+{
+	return cache.nslots && block < cache.nblocks &&
+		cache.slot_of[block] != NO_SLOT;
+}
+
+/* Dirty slots gathered for a vectored write back */
+struct flush_batch {
+	size_t n;
+	int slots[CACHE_BATCH];
+	size_t blocks[CACHE_BATCH];
+	const void *bufs[CACHE_BATCH];
+};
+
+static int batch_writeback(struct flush_batch *batch)
+{
+	if (block_writev(batch->blocks, batch->bufs, batch->n))
+		return -1;
+
+	for (size_t i = 0; i < batch->n; i++)
+		cache.slots[batch->slots[i]].dirty = 0;
+	cache.ndirty -= batch->n;
+	batch->n = 0;
+
+	return 0;
+}
+
+int cache_flush(void)
+{
+	struct flush_batch batch = { .n = 0 };
+
+	/*
+	 * Write back in disk order, so that runs of dirty blocks go out with a
+	 * single system call
+	 */
+	for (size_t b = 0; b < cache.nblocks && cache.ndirty > batch.n; b++) {
+		int s = cache.slot_of[b];
+
+		if (s == NO_SLOT || !cache.slots[s].dirty)
+			continue;
+
+		batch.slots[batch.n] = s;
+		batch.blocks[batch.n] = b;
+		batch.bufs[batch.n] = slot_data(s);
+		if (++batch.n == CACHE_BATCH && batch_writeback(&batch))
+			return -1;
+	}
+
+	return batch.n ? batch_writeback(&batch) : 0;
+}
+
+void cache_stats(size_t *hits, size_t *misses)
+{
+	if (hits)
+		*hits = cache_hits;
+	if (misses)
+		*misses = cache_misses;
+}
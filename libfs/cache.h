@@ -0,0 +1,148 @@
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <stddef.h> /* for size_t definition */
+
+/** Default number of blocks kept in the block cache */
+#define CACHE_DEFAULT_BLOCKS 64
+
+/** Block cache eviction policies */
+enum cache_policy {
+	CACHE_CLOCK,	/* Second-chance clock sweep */
+	CACHE_LRU,	/* Least recently used */
+};
+
+/**
+ * cache_init - Set up the block cache
+ * @nblocks: Number of blocks the cache can hold
+ * @policy: Eviction policy
+ *
+ * Set up a write-back cache of @nblocks blocks in front of the currently open
+ * virtual disk. A cache of 0 blocks is valid: every access then goes straight
+ * to block_read()/block_write().
+ *
+ * Return: -1 if no virtual disk is open, if the cache is already set up or if
+ * memory cannot be allocated. 0 otherwise.
+ */
+int cache_init(size_t nblocks, enum cache_policy policy);
+
+/**
+ * cache_destroy - Flush and tear down the block cache
+ *
+ * Return: -1 if the cache is not set up or if dirty blocks cannot be written
+ * back. 0 otherwise.
+ */
+int cache_destroy(void);
+
+/**
+ * cache_read - Read a block through the cache
+ * @block: Index of the block to read from
+ * @buf: Data buffer to be filled with content of block
+ *
+ * Return: -1 if the block cannot be read from disk. 0 otherwise.
+ */
+int cache_read(size_t block, void *buf);
+
+/**
+ * cache_write - Write a block through the cache
+ * @block: Index of the block to write to
+ * @buf: Data buffer to write in the block
+ *
+ * The block is only marked dirty; it reaches the disk when it is evicted, when
+ * too many blocks are dirty, or on cache_flush().
+ *
+ * Return: -1 if a dirty block could not be written back to make room. 0
+ * otherwise.
+ */
+int cache_write(size_t block, const void *buf);
+
+/**
+ * cache_readv - Read several blocks through the cache
+ * @blocks: Indices of the blocks to read from
+ * @bufs: Data buffers to be filled with content of blocks, one per block
+ * @count: Number of blocks
+ *
+ * Cached blocks are copied from the cache, the others are read from disk with
+ * block_readv() without being added to the cache, so that large streaming
+ * reads do not evict the working set.
+ *
+ * Return: -1 if the blocks cannot be read from disk. 0 otherwise.
+ */
+int cache_readv(const size_t *blocks, void *const *bufs, size_t count);
+
+/**
+ * cache_writev - Write several blocks through the cache
+ * @blocks: Indices of the blocks to write to
+ * @bufs: Data buffers to write in the blocks, one per block
+ * @count: Number of blocks
+ *
+ * The blocks are written straight to disk with block_writev(); cached copies
+ * are updated and become clean.
+ *
+ * Return: -1 if the blocks cannot be written to disk. 0 otherwise.
+ */
+int cache_writev(const size_t *blocks, const void *const *bufs, size_t count);
+
+/**
+ * cache_prefetch - Load blocks into the cache ahead of their use
+ * @blocks: Indices of the blocks to load
+ * @count: Number of blocks
+ *
+ * Blocks that are already cached are left alone, the others are read from
+ * disk with block_readv(). Prefetching does not count as cache hits or misses
+ * and is capped to half of the cache, so that it cannot flush the working set
+ * on its own.
+ *
+ * Return: -1 if the blocks cannot be read from disk. Otherwise, the number of
+ * leading blocks of @blocks that are now cached.
+ */
+int cache_prefetch(const size_t *blocks, size_t count);
+
+/**
+ * cache_pin - Keep a block in the cache and get its cached content
+ * @block: Index of the block
+ *
+ * Load @block into the cache if it is not cached yet, and keep it in the same
+ * slot until every cache_pin() of it is matched by a cache_unpin(). The cached
+ * content can be read in place meanwhile, and follows cache_write() and
+ * cache_writev() to the block. At most half of the cache can be pinned at
+ * once, so that other accesses still have room.
+ *
+ * Return: NULL if the cache holds no block, if half of it is pinned already, or
+ * if the block cannot be read from disk. Otherwise, the cached content of
+ * @block (%BLOCK_SIZE bytes).
+ */
+void *cache_pin(size_t block);
+
+/**
+ * cache_unpin - Release a pinned block
+ * @data: Pointer into the cached content of the block, as returned by
+ * cache_pin()
+ */
+void cache_unpin(const void *data);
+
+/**
+ * cache_contains - Check whether a block is cached
+ * @block: Index of the block
+ *
+ * Return: 1 if @block is in the cache, 0 otherwise.
+ */
+int cache_contains(size_t block);
+
+/**
+ * cache_flush - Write back every dirty block
+ *
+ * Return: -1 if a block cannot be written back. 0 otherwise.
+ */
+int cache_flush(void);
+
+/**
+ * cache_stats - Get cache hit and miss counts
+ * @hits: Filled with the number of accesses served from the cache
+ * @misses: Filled with the number of accesses that needed a free slot
+ *
+ * Counters accumulate across cache_init()/cache_destroy() cycles.
+ */
+void cache_stats(size_t *hits, size_t *misses);
+
+#endif /* _CACHE_H */
@@ -0,0 +1,284 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FAT_SCAN_X86
+#endif
+
+#include "fat_scan.h"
+
+/*
+ * The kernels look at SCAN_STEP entries at a time through a zero mask
+ * function, which returns a mask with 2 bits set for each entry that is 0
+ * (the layout _mm_movemask_epi8() gives for 16-bit lanes)
+ */
+#define SCAN_STEP 32
+
+typedef uint64_t (*zmask_fn)(const uint16_t *p);
+
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+
+static ALWAYS_INLINE uint64_t zmask_scalar(const uint16_t *p)
+{
+	uint64_t m = 0;
+
+	for (int i = 0; i < SCAN_STEP; i++)
+		if (!p[i])
+			m |= 3ULL << (2 * i);
+
+	return m;
+}
+
+#ifdef FAT_SCAN_X86
+__attribute__((target("sse2")))
+static ALWAYS_INLINE uint64_t zmask_sse2(const uint16_t *p)
+{
+	const __m128i zero = _mm_setzero_si128();
+	uint64_t m = 0;
+
+	for (int i = 0; i < SCAN_STEP / 8; i++) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(p + 8 * i));
+
+		m |= (uint64_t)(uint16_t)_mm_movemask_epi8(
+			_mm_cmpeq_epi16(v, zero)) << (16 * i);
+	}
+
+	return m;
+}
+
+__attribute__((target("avx2,popcnt")))
+static ALWAYS_INLINE uint64_t zmask_avx2(const uint16_t *p)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i lo = _mm256_loadu_si256((const __m256i *)p);
+	__m256i hi = _mm256_loadu_si256((const __m256i *)(p + 16));
+
+	return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi16(lo, zero)) |
+		(uint64_t)(uint32_t)_mm256_movemask_epi8(
+			_mm256_cmpeq_epi16(hi, zero)) << 32;
+}
+#endif
+
+/*
+ * Kernel bodies, inlined in each instruction set's version along with its zero
+ * mask function
+ */
+
+static ALWAYS_INLINE size_t count_zero(const uint16_t *fat, size_t n,
+				       zmask_fn zmask)
+{
+	size_t count = 0, i = 0;
+
+	for (; i + SCAN_STEP <= n; i += SCAN_STEP)
+		count += __builtin_popcountll(zmask(fat + i)) / 2;
+	for (; i < n; i++)
+		count += !fat[i];
+
+	return count;
+}
+
+static ALWAYS_INLINE size_t find_zero(const uint16_t *fat, size_t n,
+				      size_t hint, zmask_fn zmask)
+{
+	size_t i = hint;
+
+	for (; i + SCAN_STEP <= n; i += SCAN_STEP) {
+		uint64_t m = zmask(fat + i);
+
+		if (m)
+			return i + __builtin_ctzll(m) / 2;
+	}
+	for (; i < n; i++)
+		if (!fat[i])
+			return i;
+
+	return n;
+}
+
+/* Current and longest runs of zero entries seen so far */
+struct run_state {
+	size_t cur, cur_start;
+	size_t best, best_start;
+};
+
+/* Account for @count zero entries starting at @i */
+static inline void run_add(struct run_state *st, size_t i, size_t count)
+{
+	if (!st->cur)
+		st->cur_start = i;
+	st->cur += count;
+	if (st->cur > st->best) {
+		st->best = st->cur;
+		st->best_start = st->cur_start;
+	}
+}
+
+static ALWAYS_INLINE size_t find_zero_run(const uint16_t *fat, size_t n,
+					  size_t len, size_t *run,
+					  zmask_fn zmask)
+{
+	struct run_state st = { 0, 0, 0, 0 };
+	size_t i = 0;
+
+	if (!len)
+		len = 1;
+
+	for (; i + SCAN_STEP <= n; i += SCAN_STEP) {
+		uint64_t m = zmask(fat + i);
+
+		if (m == ~0ULL) {
+			/* Whole step of zero entries */
+			run_add(&st, i, SCAN_STEP);
+		} else if (!m) {
+			st.cur = 0;
+			continue;
+		} else {
+			for (int j = 0; j < SCAN_STEP && st.cur < len; j++) {
+				if ((m >> (2 * j)) & 1)
+					run_add(&st, i + j, 1);
+				else
+					st.cur = 0;
+			}
+		}
+		if (st.cur >= len)
+			goto found;
+	}
+	for (; i < n; i++) {
+		if (fat[i])
+			st.cur = 0;
+		else
+			run_add(&st, i, 1);
+		if (st.cur >= len)
+			goto found;
+	}
+
+	*run = st.best;
+	return st.best_start;
+
+found:
+	*run = st.cur;
+	return st.cur_start;
+}
+
+/*
+ * Instruction set specific versions
+ */
+
+struct fat_scan_ops {
+	size_t (*count_zero)(const uint16_t *fat, size_t n);
+	size_t (*find_zero)(const uint16_t *fat, size_t n, size_t hint);
+	size_t (*find_zero_run)(const uint16_t *fat, size_t n, size_t len,
+				size_t *run);
+};
+
+static size_t count_zero_scalar(const uint16_t *fat, size_t n)
+{
+	return count_zero(fat, n, zmask_scalar);
+}
+
+static size_t find_zero_scalar(const uint16_t *fat, size_t n, size_t hint)
+{
+	return find_zero(fat, n, hint, zmask_scalar);
+}
+
+static size_t find_zero_run_scalar(const uint16_t *fat, size_t n, size_t len,
+				   size_t *run)
+{
+	return find_zero_run(fat, n, len, run, zmask_scalar);
+}
+
+static const struct fat_scan_ops scalar_ops = {
+	count_zero_scalar, find_zero_scalar, find_zero_run_scalar,
+};
+
+#ifdef FAT_SCAN_X86
+__attribute__((target("sse2")))
+static size_t count_zero_sse2(const uint16_t *fat, size_t n)
+{
+	return count_zero(fat, n, zmask_sse2);
+}
+
+__attribute__((target("sse2")))
+static size_t find_zero_sse2(const uint16_t *fat, size_t n, size_t hint)
+{
+	return find_zero(fat, n, hint, zmask_sse2);
+}
+
+__attribute__((target("sse2")))
+static size_t find_zero_run_sse2(const uint16_t *fat, size_t n, size_t len,
+				 size_t *run)
+{
+	return find_zero_run(fat, n, len, run, zmask_sse2);
+}
+
+static const struct fat_scan_ops sse2_ops = {
+	count_zero_sse2, find_zero_sse2, find_zero_run_sse2,
+};
+
+__attribute__((target("avx2,popcnt")))
+static size_t count_zero_avx2(const uint16_t *fat, size_t n)
+{
+	return count_zero(fat, n, zmask_avx2);
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t find_zero_avx2(const uint16_t *fat, size_t n, size_t hint)
+{
+	return find_zero(fat, n, hint, zmask_avx2);
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t find_zero_run_avx2(const uint16_t *fat, size_t n, size_t len,
+				 size_t *run)
+{
+	return find_zero_run(fat, n, len, run, zmask_avx2);
+}
+
+static const struct fat_scan_ops avx2_ops = {
+	count_zero_avx2, find_zero_avx2, find_zero_run_avx2,
+};
+#endif
+
+/* Versions picked for this CPU, NULL until the first call */
+static const struct fat_scan_ops *scan_ops;
+
+static const struct fat_scan_ops *ops_get(void)
+{
+	const struct fat_scan_ops *ops = __atomic_load_n(&scan_ops,
+							 __ATOMIC_RELAXED);
+
+	if (ops)
+		return ops;
+
+	ops = &scalar_ops;
+#ifdef FAT_SCAN_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+		ops = &avx2_ops;
+	else if (__builtin_cpu_supports("sse2"))
+		ops = &sse2_ops;
+#endif
+	__atomic_store_n(&scan_ops, ops, __ATOMIC_RELAXED);
+
+	return ops;
+}
+
+size_t fat_count_zero(const uint16_t *fat, size_t n)
+{
+	return ops_get()->count_zero(fat, n);
+}
+
+size_t fat_find_zero(const uint16_t *fat, size_t n, size_t hint)
+{
+	if (hint >= n)
+		return n;
+
+	return ops_get()->find_zero(fat, n, hint);
+}
+
+size_t fat_find_zero_run(const uint16_t *fat, size_t n, size_t len,
+			 size_t *run)
+{
+	return ops_get()->find_zero_run(fat, n, len, run);
+}
@@ -0,0 +1,50 @@
+#ifndef _FAT_SCAN_H
+#define _FAT_SCAN_H
+
+#include <stddef.h> /* for size_t definition */
+#include <stdint.h> /* for uint16_t definition */
+
+/*
+ * FAT scanning kernels
+ *
+ * Each kernel has a scalar version, an SSE2 version and an AVX2 version; the
+ * best one the CPU supports is picked the first time a kernel is called.
+ */
+
+/**
+ * fat_count_zero - Count the zero entries of a FAT
+ * @fat: FAT entries
+ * @n: Number of entries
+ *
+ * Return: The number of entries of @fat that are 0.
+ */
+size_t fat_count_zero(const uint16_t *fat, size_t n);
+
+/**
+ * fat_find_zero - Find the first zero entry of a FAT from a hint
+ * @fat: FAT entries
+ * @n: Number of entries
+ * @hint: Index to start looking at
+ *
+ * Return: The index of the first entry of @fat that is 0 at or after @hint, or
+ * @n if there is none.
+ */
+size_t fat_find_zero(const uint16_t *fat, size_t n, size_t hint);
+
+/**
+ * fat_find_zero_run - Find a run of consecutive zero entries of a FAT
+ * @fat: FAT entries
+ * @n: Number of entries
+ * @len: Wanted number of consecutive zero entries
+ * @run: Filled with the length of the run found
+ *
+ * Look for the first run of at least @len consecutive zero entries. If there is
+ * none, settle for the longest run; *@run is then less than @len, and 0 if no
+ * entry is 0 at all.
+ *
+ * Return: The index of the first entry of the run found.
+ */
+size_t fat_find_zero_run(const uint16_t *fat, size_t n, size_t len,
+			 size_t *run);
+
+#endif /* _FAT_SCAN_H */
@@ -1,24 +1,54 @@
 #include <assert.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/uio.h>
 
+#include "cache.h"
 #include "disk.h"
+#include "fat_scan.h"
 #include "fs.h"
 
 /* TODO: Phase 1 */
 
 uint16_t allocate_new_block(void);
 size_t minimum(size_t a, size_t b);
+size_t maximum(size_t a, size_t b);
 uint16_t get_offset_blk(int fd, size_t offset);
+uint16_t file_nth_block(int root_dir_index, size_t n);
+uint16_t next_block_alloc(int root_dir_index, uint16_t block);
+char *data_block_map(uint16_t block);
 int file_blk_count(uint32_t sz);
-static inline int32_t clamp(int32_t val, int32_t min, int32_t max);
 void expand_file(int fd, size_t new_size);
 void link_new_block_to_file(int root_dir_index, uint16_t new_block);
 
 #define FAT_EOC 0xFFFF
 
+// Maximum number of whole blocks handed to the cache/disk layer at once
+#define IO_BATCH 64
+
+// Readahead window bounds, in blocks
+#define RA_MIN_WINDOW 4
+#define RA_MAX_WINDOW 64
+
+// "FSUM", marks a valid free space summary in the superblock padding
+#define SUMMARY_MAGIC 0x4d555346
+
+// Free space summary kept in the superblock padding, which other
+// implementations leave alone, so that a mount after a clean unmount does not
+// have to count the free FAT entries again
+struct FreeSpaceSummary
+{
+    uint32_t magic;                         // SUMMARY_MAGIC if the summary is valid
+    uint8_t clean;                          // Set at unmount, cleared while mounted
+    uint16_t free_count;                    // Number of free data blocks
+    uint16_t free_hint;                     // Data block the next allocation starts at
+    uint32_t root_dir_sum;                  // Checksum of the root directory block
+    uint16_t fat_block_free[UINT8_MAX];     // Number of free entries of each FAT block
+} __attribute__((packed));
+
 struct SuperBlock
 {
     char signature[8];         // File system signature "ECS150FS"
@@ -27,8 +57,10 @@ struct SuperBlock
     uint16_t data_start_index; // Block index where data blocks start
     uint16_t data_blocks;      // Total number of data blocks
     uint8_t fat_blocks;        // Number of blocks for the FAT
-    uint8_t unused[4079];      // Padding to make the superblock size 4096 bytes
+    struct FreeSpaceSummary summary;
+    uint8_t unused[4079 - sizeof(struct FreeSpaceSummary)]; // Padding to make the superblock size 4096 bytes
 } __attribute__((packed));
+_Static_assert(sizeof(struct SuperBlock) == BLOCK_SIZE, "superblock is not one block");
 
 struct RootDirectory
 {
@@ -43,6 +75,15 @@ struct FileDescriptor
     int used;           // A flag to indicate if this file descriptor is in use
     int root_dir_index; // Index of the file in the root directory
     size_t offset;      // Current offset within the file
+    size_t ra_next;     // Offset the next read starts at if access is sequential
+    size_t ra_end;      // Index of the first file block not prefetched yet
+    size_t ra_window;   // Number of blocks to keep prefetched ahead of the reader
+    void *scratch;      // Block buffer for partial block transfers, see fd_scratch()
+    int wb_enabled;     // Set if small writes go through the write-behind buffer
+    char *wb_buf;       // Write-behind buffer, see wb_write()
+    size_t wb_start;    // File offset of the first byte held in wb_buf
+    size_t wb_len;      // Number of bytes held in wb_buf
+    size_t mapped;      // Number of extents from fs_map() not released yet
 };
 
 static struct SuperBlock superblock;
@@ -50,9 +91,480 @@ static struct RootDirectory *root_directory = NULL;
 uint16_t *fat16 = NULL;
 struct FileDescriptor fd_table[FS_OPEN_MAX_COUNT] = {0};
 
+static int wb_flush(struct FileDescriptor *desc);
+static int wb_flush_all(void);
+
+// Logical to physical block map of a file, a cached prefix of its FAT chain
+// that file_nth_block() builds lazily and extends as the file grows
+struct BlockMap
+{
+    uint16_t *blocks;   // blocks[i] is the data block holding file block i
+    size_t count;       // Number of file blocks mapped so far
+    size_t capacity;    // Number of entries allocated
+};
+static struct BlockMap block_maps[FS_FILE_MAX_COUNT];
+
+// Last data block of each file's chain (FAT_EOC for empty files), found at
+// mount time and kept up to date so that appending never walks the chain
+static uint16_t file_tails[FS_FILE_MAX_COUNT];
+
+static void file_tails_build(void)
+{
+    for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+        uint16_t block = FAT_EOC;
+        if (root_directory[i].filename[0] != '\0') {
+            block = root_directory[i].first_data_block;
+            while (block != FAT_EOC && fat16[block] != FAT_EOC) {
+                block = fat16[block];
+            }
+        }
+        file_tails[i] = block;
+    }
+}
+
+// Open-addressing (linear probing) hash table of the root directory entries in
+// use, keyed on filename: each slot holds an entry index + 1, or 0 if empty.
+// Entries are removed by shifting the rest of their probe sequence back, so
+// lookups never have to step over tombstones.
+#define NAME_HASH_SLOTS (2 * FS_FILE_MAX_COUNT)
+#define NAME_HASH_MASK (NAME_HASH_SLOTS - 1)
+_Static_assert((NAME_HASH_SLOTS & NAME_HASH_MASK) == 0, "name hash size is not a power of two");
+static uint8_t name_hash[NAME_HASH_SLOTS];
+
+// Bit i of word i / 64 is set when root directory entry i is free
+static uint64_t rdir_free_map[FS_FILE_MAX_COUNT / 64];
+static int rdir_free_count;
+_Static_assert(FS_FILE_MAX_COUNT % 64 == 0, "free entry bitmap does not cover the root directory");
+
+static size_t name_hash_home(const char *filename)
+{
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < FS_FILENAME_LEN && filename[i] != '\0'; i++) {
+        hash = (hash ^ (uint8_t)filename[i]) * 16777619u;
+    }
+    return hash & NAME_HASH_MASK;
+}
+
+// Slot holding the entry named filename, or the empty slot ending its probe
+// sequence
+static size_t name_hash_slot(const char *filename)
+{
+    size_t slot = name_hash_home(filename);
+
+    while (name_hash[slot] != 0
+           && strncmp(root_directory[name_hash[slot] - 1].filename, filename,
+                      FS_FILENAME_LEN) != 0) {
+        slot = (slot + 1) & NAME_HASH_MASK;
+    }
+    return slot;
+}
+
+// Root directory index of the file named filename, or -1 if there is none
+static int name_lookup(const char *filename)
+{
+    return (int)name_hash[name_hash_slot(filename)] - 1;
+}
+
+static void name_insert(int root_dir_index)
+{
+    name_hash[name_hash_slot(root_directory[root_dir_index].filename)] = root_dir_index + 1;
+}
+
+// Must be called while the entry still holds its filename
+static void name_remove(int root_dir_index)
+{
+    size_t hole = name_hash_slot(root_directory[root_dir_index].filename);
+    size_t slot = hole;
+
+    name_hash[hole] = 0;
+    for (;;) {
+        slot = (slot + 1) & NAME_HASH_MASK;
+        if (name_hash[slot] == 0) {
+            return;
+        }
+        // An entry can fill the hole unless its home slot lies cyclically
+        // after the hole, where probing for it would stop first
+        size_t home = name_hash_home(root_directory[name_hash[slot] - 1].filename);
+        if (((slot - home) & NAME_HASH_MASK) >= ((slot - hole) & NAME_HASH_MASK)) {
+            name_hash[hole] = name_hash[slot];
+            name_hash[slot] = 0;
+            hole = slot;
+        }
+    }
+}
+
+static void rdir_free_set(int root_dir_index, int free_entry)
+{
+    uint64_t bit = 1ULL << (root_dir_index % 64);
+
+    if (free_entry) {
+        rdir_free_map[root_dir_index / 64] |= bit;
+        rdir_free_count++;
+    } else {
+        rdir_free_map[root_dir_index / 64] &= ~bit;
+        rdir_free_count--;
+    }
+}
+
+// First free root directory entry, or -1 if the root directory is full
+static int rdir_free_find(void)
+{
+    for (size_t i = 0; i < FS_FILE_MAX_COUNT / 64; i++) {
+        if (rdir_free_map[i] != 0) {
+            return (int)(i * 64) + __builtin_ctzll(rdir_free_map[i]);
+        }
+    }
+    return -1;
+}
+
+static void name_index_build(void)
+{
+    memset(name_hash, 0, sizeof(name_hash));
+    memset(rdir_free_map, 0, sizeof(rdir_free_map));
+    rdir_free_count = 0;
+    for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+        if (root_directory[i].filename[0] == '\0') {
+            rdir_free_set(i, 1);
+        } else {
+            name_insert(i);
+        }
+    }
+}
+
+static void block_map_reset(int root_dir_index)
+{
+    free(block_maps[root_dir_index].blocks);
+    memset(&block_maps[root_dir_index], 0, sizeof(struct BlockMap));
+}
+
+// Block cache configuration, applied at mount time
+static size_t cache_blocks = CACHE_DEFAULT_BLOCKS;
+static enum cache_policy cache_policy = CACHE_CLOCK;
+
+// Asynchronous block I/O queue depth, applied at mount time
+static unsigned aio_depth = 0;
+
+// Number of FAT entries in a FAT block
+#define FAT_BLOCK_ENTRIES (BLOCK_SIZE / sizeof(uint16_t))
+
+// Free data block index, built at mount time and kept up to date by
+// fat_set(): bit i of free_map is set when data block i is free, and bit w of
+// free_summary when word w of free_map has any bit set, so that a free block
+// is found without scanning the FAT
+static uint64_t *free_map;
+static uint64_t *free_summary;
+static size_t free_words;   // Number of words of free_map
+static size_t free_count;   // Number of free data blocks
+static size_t free_hint;    // Word of free_map the next allocation starts at
+
+static void free_map_destroy(void)
+{
+    free(free_map);
+    free(free_summary);
+    free_map = NULL;
+    free_summary = NULL;
+    free_words = 0;
+    free_count = 0;
+    free_hint = 0;
+}
+
+static void free_map_mark(uint16_t block, int is_free)
+{
+    size_t w = block / 64;
+    uint64_t bit = 1ULL << (block % 64);
+
+    if (is_free && !(free_map[w] & bit)) {
+        free_map[w] |= bit;
+        free_count++;
+    } else if (!is_free && (free_map[w] & bit)) {
+        free_map[w] &= ~bit;
+        free_count--;
+    }
+
+    if (free_map[w]) {
+        free_summary[w / 64] |= 1ULL << (w % 64);
+    } else {
+        free_summary[w / 64] &= ~(1ULL << (w % 64));
+    }
+}
+
+// Number of data block entries in FAT block @fat_block
+static size_t fat_block_entries(size_t fat_block)
+{
+    size_t first = fat_block * FAT_BLOCK_ENTRIES;
+
+    return first < superblock.data_blocks
+           ? minimum(FAT_BLOCK_ENTRIES, superblock.data_blocks - first) : 0;
+}
+
+// Mark the free entries of FAT block @fat_block, @nfree of them, in the index
+static void free_map_fill(size_t fat_block, size_t nfree)
+{
+    size_t first = fat_block * FAT_BLOCK_ENTRIES;
+    size_t n = fat_block_entries(fat_block);
+
+    if (nfree == n) {
+        // Entirely free, no need to look at the entries
+        for (size_t i = 0; i < n; i++) {
+            free_map_mark(first + i, 1);
+        }
+    } else if (nfree != 0) {
+        for (size_t i = fat_find_zero(fat16 + first, n, 0); i < n;
+             i = fat_find_zero(fat16 + first, n, i + 1)) {
+            free_map_mark(first + i, 1);
+        }
+    }
+}
+
+static int free_map_alloc(void)
+{
+    free_words = (superblock.data_blocks + 63) / 64;
+    free_map = calloc(free_words, sizeof(uint64_t));
+    free_summary = calloc((free_words + 63) / 64, sizeof(uint64_t));
+    if (!free_map || !free_summary) {
+        free_map_destroy();
+        return -1;
+    }
+    free_count = 0;
+    free_hint = 0;
+    return 0;
+}
+
+static int free_map_build(void)
+{
+    if (free_map_alloc() == -1) {
+        return -1;
+    }
+    for (int i = 0; i < superblock.fat_blocks; i++) {
+        free_map_fill(i, fat_count_zero(fat16 + i * FAT_BLOCK_ENTRIES,
+                                        fat_block_entries(i)));
+    }
+    return 0;
+}
+
+// Find a free data block, starting at the allocation hint and wrapping around
+// the disk. Return 0 if there is none (block 0 is never free).
+static uint16_t free_map_find(void)
+{
+    if (free_count == 0) {
+        return 0;
+    }
+
+    size_t w = free_hint;
+    if (!free_map[w]) {
+        size_t summary_words = (free_words + 63) / 64;
+        for (size_t k = 0; k <= summary_words; ++k) {
+            size_t sw = (free_hint / 64 + k) % summary_words;
+            uint64_t bits = free_summary[sw];
+            if (k == 0) {
+                bits &= ~0ULL << (free_hint % 64); // Words past the hint first
+            }
+            if (bits) {
+                w = sw * 64 + __builtin_ctzll(bits);
+                break;
+            }
+        }
+    }
+
+    free_hint = w;
+    return w * 64 + __builtin_ctzll(free_map[w]);
+}
+
+// FNV-1a hash of the root directory, which any other implementation changes
+// whenever it adds or removes blocks, so that a summary that went stale is
+// detected
+static uint32_t root_dir_checksum(void)
+{
+    const uint8_t *bytes = (const uint8_t *)root_directory;
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < FS_FILE_MAX_COUNT * sizeof(struct RootDirectory); i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Build the free block index from the superblock summary if it is valid for
+// the image as it is on disk: FAT blocks it reports as entirely free or
+// entirely used are not scanned. Return -1 if the index has to be built from
+// the FAT alone instead.
+static int free_space_load(void)
+{
+    struct FreeSpaceSummary *summary = &superblock.summary;
+
+    if (summary->magic != SUMMARY_MAGIC || !summary->clean
+        || summary->root_dir_sum != root_dir_checksum()) {
+        return -1;
+    }
+
+    size_t total = 0;
+    for (int i = 0; i < superblock.fat_blocks; i++) {
+        if (summary->fat_block_free[i] > fat_block_entries(i)) {
+            return -1;
+        }
+        total += summary->fat_block_free[i];
+    }
+    if (total != summary->free_count) {
+        return -1;
+    }
+
+    if (free_map_alloc() == -1) {
+        return -1;
+    }
+    for (int i = 0; i < superblock.fat_blocks; i++) {
+        free_map_fill(i, summary->fat_block_free[i]);
+    }
+    // The FAT blocks that were scanned must agree with the summary too
+    if (free_count != summary->free_count) {
+        free_map_destroy();
+        return -1;
+    }
+    free_hint = summary->free_hint / 64 < free_words ? summary->free_hint / 64 : 0;
+    return 0;
+}
+
+// Record the free space counts in the superblock summary and write it out,
+// flagged clean (@clean set) or not
+static int free_space_store(int clean)
+{
+    struct FreeSpaceSummary *summary = &superblock.summary;
+
+    summary->magic = SUMMARY_MAGIC;
+    summary->clean = clean;
+    summary->free_count = free_count;
+    summary->free_hint = free_hint * 64;
+    summary->root_dir_sum = root_dir_checksum();
+    for (int i = 0; i < superblock.fat_blocks; i++) {
+        // A FAT block covers a whole number of index words
+        size_t first = i * FAT_BLOCK_ENTRIES / 64;
+        size_t end = minimum(first + FAT_BLOCK_ENTRIES / 64, free_words);
+        uint16_t nfree = 0;
+        for (size_t w = first; w < end; w++) {
+            nfree += __builtin_popcountll(free_map[w]);
+        }
+        summary->fat_block_free[i] = nfree;
+    }
+    return block_write(0, &superblock);
+}
+
+// Find a run of contiguous free data blocks: the first one of at least @want
+// blocks, or the longest one if none is that long. Return the length of the
+// run, which starts at *@start, or 0 if no block is free.
+static size_t free_run_find(size_t want, uint16_t *start)
+{
+    size_t run;
+
+    *start = fat_find_zero_run(fat16, superblock.data_blocks, want, &run);
+    return run;
+}
+
+static int data_block_free(size_t block)
+{
+    return block < superblock.data_blocks && fat16[block] == 0;
+}
+
+// Defragmentation cursor: the root directory entry and the file block that
+// the next fs_defrag() call resumes at
+static int defrag_entry;
+static size_t defrag_block;
+
+// I/O statistics, the disk transfers of the disks unmounted so far included
+static struct fs_stats io_stats;
+
+#if FS_STATS_LAT_BUCKETS != BLOCK_LAT_BUCKETS
+#error "fs and block latency histograms differ"
+#endif
+
+static void io_stats_add(struct fs_io_stats *sum, const struct block_op_stats *op)
+{
+    sum->requests += op->requests;
+    sum->blocks += op->blocks;
+    sum->errors += op->errors;
+    for (int i = 0; i < FS_STATS_LAT_BUCKETS; ++i) {
+        sum->lat[i] += op->lat[i];
+    }
+}
+
+// Fold the transfers of the disk about to be closed into the statistics
+static void io_stats_retire_disk(void)
+{
+    struct block_stats disk_stats;
+
+    if (block_stats(&disk_stats) == 0) {
+        io_stats_add(&io_stats.disk_reads, &disk_stats.read);
+        io_stats_add(&io_stats.disk_writes, &disk_stats.write);
+    }
+}
+
+// FAT blocks and root directory modified since they were last written out
+static uint8_t fat_dirty[UINT8_MAX + 1];
+static int root_dir_dirty;
+
+// Set FAT entry @index, remembering that its FAT block must be written out
+// and keeping the free block index in step
+static void fat_set(uint16_t index, uint16_t value)
+{
+    if (index < superblock.data_blocks) {
+        free_map_mark(index, value == 0);
+    }
+    fat16[index] = value;
+    fat_dirty[index / FAT_BLOCK_ENTRIES] = 1;
+}
+
+// Transfer the FAT blocks and the root directory block between memory and
+// disk (write if @write is set, read otherwise). Only the blocks modified
+// since the last write are written.
+static int metadata_io(int write)
+{
+    size_t blocks[UINT8_MAX + 2];
+    void *bufs[UINT8_MAX + 2];
+    int count = 0;
+
+    for (int i = 0; i < superblock.fat_blocks; ++i) {
+        if (write && !fat_dirty[i]) {
+            continue;
+        }
+        blocks[count] = 1 + i;
+        bufs[count] = fat16 + (i * BLOCK_SIZE / sizeof(uint16_t));
+        count++;
+    }
+    if (!write || root_dir_dirty) {
+        blocks[count] = superblock.root_dir_index;
+        bufs[count] = root_directory;
+        count++;
+    }
+    if (count == 0) {
+        return 0;
+    }
+
+    if (!write) {
+        return block_readv(blocks, bufs, count);
+    }
+    if (block_writev(blocks, (const void *const *)bufs, count) == -1) {
+        return -1;
+    }
+    memset(fat_dirty, 0, sizeof(fat_dirty));
+    root_dir_dirty = 0;
+    return 0;
+}
+
 int fs_mount(const char *diskname) 
 {
-    if (block_disk_open(diskname) == -1) {
+    return fs_mount_flags(diskname, 0);
+}
+
+int fs_mount_flags(const char *diskname, int flags)
+{
+    int disk_flags = 0;
+    if (flags & FS_MOUNT_MMAP) {
+        disk_flags |= BLOCK_DISK_MMAP;
+    }
+    if (flags & FS_MOUNT_DIRECT) {
+        disk_flags |= BLOCK_DISK_DIRECT;
+    }
+
+    if (block_disk_open_flags(diskname, disk_flags) == -1) {
         return -1;
     }
 
@@ -73,29 +585,69 @@ int fs_mount(const char *diskname)
     }
 
     fat16 = malloc(superblock.fat_blocks * BLOCK_SIZE);
-    if (fat16 == NULL) {
+    root_directory = malloc(sizeof(struct RootDirectory) * FS_FILE_MAX_COUNT);
+    if (fat16 == NULL || root_directory == NULL) {
+        free(root_directory);
+        free(fat16);
+        root_directory = NULL;
+        fat16 = NULL;
         block_disk_close();
         return -1;
     }
 
-    for (int i = 0; i < superblock.fat_blocks; ++i) {
-        if (block_read(1 + i, fat16 + (i * BLOCK_SIZE / sizeof(uint16_t))) == -1) {
+    // Read the FAT and the root directory, which normally follow each other
+    // on disk, in a single vectored request
+    memset(fat_dirty, 0, sizeof(fat_dirty));
+    root_dir_dirty = 0;
+    defrag_entry = 0;
+    defrag_block = 0;
+    if (metadata_io(0) == -1) {
+        free(root_directory);
+        free(fat16);
+        root_directory = NULL;
+        fat16 = NULL;
+        block_disk_close();
+        return -1;
+    }
+
+    file_tails_build();
+    name_index_build();
+    if (free_space_load() == -1 && free_map_build() == -1) {
+        free(root_directory);
+        free(fat16);
+        root_directory = NULL;
+        fat16 = NULL;
+        block_disk_close();
+        return -1;
+    }
+
+    // Until the next clean unmount, a summary on disk cannot be trusted,
+    // whether it was used for this mount or not
+    if (superblock.summary.magic == SUMMARY_MAGIC && superblock.summary.clean) {
+        superblock.summary.clean = 0;
+        if (block_write(0, &superblock) == -1) {
+            free_map_destroy();
+            free(root_directory);
             free(fat16);
+            root_directory = NULL;
+            fat16 = NULL;
             block_disk_close();
             return -1;
         }
     }
 
-    root_directory = malloc(sizeof(struct RootDirectory) * FS_FILE_MAX_COUNT);
-    if (root_directory == NULL) {
-        free(fat16);
-        block_disk_close();
-        return -1;
+    // Keep multi-block requests going with synchronous I/O if no engine starts
+    if (aio_depth > 1 && !block_map(0)) {
+        block_aio_start(aio_depth, 0);
     }
 
-    if (block_read(superblock.root_dir_index, root_directory) == -1) {
+    // A mapped disk already lives in memory, caching it would only add a copy
+    if (cache_init(block_map(0) ? 0 : cache_blocks, cache_policy) == -1) {
+        free_map_destroy();
         free(root_directory);
         free(fat16);
+        root_directory = NULL;
+        fat16 = NULL;
         block_disk_close();
         return -1;
     }
@@ -115,24 +667,31 @@ int fs_umount(void)
         }
     }
 
-    for (int i = 0; i < superblock.fat_blocks; ++i)
+    if (fs_sync() == -1)
     {
-        if (block_write(1 + i, fat16 + (i * BLOCK_SIZE / sizeof(uint16_t))) == -1)
-        {
-            return -1;
-        }
+        return -1;
+    }
+
+    if (cache_destroy() == -1)
+    {
+        return -1;
     }
 
-    if (block_write(superblock.root_dir_index, root_directory) == -1)
+    if (free_space_store(1) == -1)
     {
         return -1;
     }
 
+    for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+        block_map_reset(i);
+    }
+    free_map_destroy();
     free(fat16);
     free(root_directory);
     fat16 = NULL;
     root_directory = NULL;
 
+    io_stats_retire_disk();
     if (block_disk_close() == -1)
     {
         return -1;
@@ -142,25 +701,34 @@ int fs_umount(void)
     return 0;
 }
 
+// Write modified data, then modified metadata, back to disk
+static int sync_all(void)
+{
+    // Data blocks first, so that the metadata never points to stale data
+    if (wb_flush_all() == -1 || cache_flush() == -1) {
+        return -1;
+    }
+    return metadata_io(1);
+}
+
+int fs_sync(void)
+{
+    if (!fat16 || !root_directory) {
+        return -1;
+    }
+
+    return sync_all();
+}
+
 int fs_info(void) 
 {
     if (!fat16 || !root_directory) {
         return -1;
     }
     
-    int fat_free_count = 0;
-    for (int i = 0; i < superblock.data_blocks; i++) {
-        if (fat16[i] == 0) {
-            fat_free_count++;
-        }
-    }
+    int fat_free_count = free_count;
     
-    int free_rdir_entries = 0;
-    for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-        if (root_directory[i].filename[0] == '\0') {
-            free_rdir_entries++;
-        }
-    }
+    int free_rdir_entries = rdir_free_count;
     
     printf("FS Info:\n");
     printf("total_blk_count=%d\n", superblock.total_blocks);
@@ -173,6 +741,40 @@ int fs_info(void)
     return 0;
 }
 
+static int filename_valid(const char *filename)
+{
+    return filename != NULL && strlen(filename) != 0 && strlen(filename) <= FS_FILENAME_LEN;
+}
+
+// fs_create() once the file system is known to be mounted
+static int file_create(const char *filename)
+{
+    if (!filename_valid(filename)) {
+        return -1;
+    }
+
+    if (name_lookup(filename) != -1) {
+        return -1;
+    }
+
+    int index = rdir_free_find();
+
+    // Check if the root directory is full
+    if (index == -1) {
+        return -1;
+    }
+
+    strncpy(root_directory[index].filename, filename, FS_FILENAME_LEN);
+    root_directory[index].file_size = 0;
+    root_directory[index].first_data_block = FAT_EOC;
+    file_tails[index] = FAT_EOC;
+    root_dir_dirty = 1;
+    rdir_free_set(index, 0);
+    name_insert(index);
+
+    return 0;
+}
+
 int fs_create(const char *filename)
 {
 	/* TODO: Phase 2 */
@@ -180,309 +782,1437 @@ int fs_create(const char *filename)
     if (!fat16 || !root_directory) {
         return -1;
     }
-    
-    if (filename == NULL || strlen(filename) == 0 || strlen(filename) > FS_FILENAME_LEN) {
+
+    return file_create(filename);
+}
+
+// Free the data blocks and the root directory entry of a file that is not open
+static void file_delete(int index)
+{
+    uint16_t block_index = root_directory[index].first_data_block;
+    while (block_index != FAT_EOC) {
+        uint16_t next_block_index = fat16[block_index];
+        fat_set(block_index, 0);
+        block_index = next_block_index;
+    }
+
+    name_remove(index);
+    rdir_free_set(index, 1);
+    memset(&root_directory[index], 0, sizeof(struct RootDirectory));
+    root_dir_dirty = 1;
+    file_tails[index] = FAT_EOC;
+    block_map_reset(index);
+}
+
+static int file_is_open(int index)
+{
+    for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+        if (fd_table[i].used && fd_table[i].root_dir_index == index) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Whether extents from fs_map() not released yet point into a file's blocks
+static int file_is_mapped(int index)
+{
+    for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+        if (fd_table[i].used && fd_table[i].root_dir_index == index &&
+            fd_table[i].mapped != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int fs_delete(const char *filename)
+{
+	/* TODO: Phase 2 */
+    if (!fat16 || !root_directory) {
+        return -1;
+    }
+
+    if (!filename_valid(filename)) {
+        return -1;
+    }
+    int index = name_lookup(filename);
+
+    if (index == -1){
+        return -1;
+    }
+
+    if (file_is_open(index)) {
+        return -1;
+    }
+
+    file_delete(index);
+
+    return 0;
+}
+
+int fs_ls(void)
+{
+    if (!fat16 || !root_directory)
+    {
+        return -1;
+    }
+
+    // Iterate through root directory entries and print information about each file
+    for (int i = 0; i < FS_FILE_MAX_COUNT; ++i)
+    {
+        if (root_directory[i].filename[0] != '\0')
+        { // Check if entry is not empty
+            printf("file: %s, size: %d, data_blk: %d\n",
+                   root_directory[i].filename,
+                   root_directory[i].file_size,
+                   root_directory[i].first_data_block);
+        }
+    }
+    return 0;
+}
+
+// fs_open() once the file system is known to be mounted, looking for a free
+// file descriptor from first_fd on (all of them before first_fd are in use)
+static int file_open(const char *filename, int first_fd)
+{
+    if (!filename_valid(filename)) {
+        return -1;
+    }
+    int index = name_lookup(filename);
+    if (index == -1){
+        return -1;
+    }
+    int fd = -1;
+    for (int i = first_fd; i < FS_OPEN_MAX_COUNT; ++i) {
+        if (fd_table[i].used == 0) {
+            fd = i;
+            break;
+        }
+    }
+    if (fd == -1) {
+            return -1;
+    }
+fd_table[fd].used = 1;
+fd_table[fd].root_dir_index = index;
+fd_table[fd].offset = 0;
+fd_table[fd].ra_next = 0;
+fd_table[fd].ra_end = 0;
+fd_table[fd].ra_window = 0;
+fd_table[fd].wb_enabled = 0;
+fd_table[fd].wb_len = 0;
+fd_table[fd].mapped = 0;
+
+return fd;
+}
+
+int fs_open(const char *filename)
+{
+	/* TODO: Phase 3 */
+    if (!fat16 || !root_directory) {
+        return -1;
+    }
+    return file_open(filename, 0);
+}
+
+// The batch versions check the mount once, resolve each name through the name
+// index, and sync once at the end instead of leaving it to the next fs_sync(),
+// modified data first so that the metadata written never points to stale data
+
+int fs_create_many(const char **filenames, size_t count, int *status)
+{
+    if (!fat16 || !root_directory || (count && (!filenames || !status))) {
+        return -1;
+    }
+
+    int created = 0;
+    for (size_t i = 0; i < count; i++) {
+        status[i] = file_create(filenames[i]);
+        if (status[i] == 0) {
+            created++;
+        }
+    }
+
+    if (created && sync_all() == -1) {
+        return -1;
+    }
+    return created;
+}
+
+int fs_delete_many(const char **filenames, size_t count, int *status)
+{
+    if (!fat16 || !root_directory || (count && (!filenames || !status))) {
+        return -1;
+    }
+
+    // Files that are open, gathered once for the whole batch
+    uint8_t open[FS_FILE_MAX_COUNT] = {0};
+    for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+        if (fd_table[i].used) {
+            open[fd_table[i].root_dir_index] = 1;
+        }
+    }
+
+    int deleted = 0;
+    for (size_t i = 0; i < count; i++) {
+        int index = filename_valid(filenames[i]) ? name_lookup(filenames[i]) : -1;
+
+        if (index == -1 || open[index]) {
+            status[i] = -1;
+            continue;
+        }
+        file_delete(index);
+        status[i] = 0;
+        deleted++;
+    }
+
+    if (deleted && sync_all() == -1) {
+        return -1;
+    }
+    return deleted;
+}
+
+int fs_open_many(const char **filenames, size_t count, int *fds)
+{
+    if (!fat16 || !root_directory || (count && (!filenames || !fds))) {
+        return -1;
+    }
+
+    int opened = 0;
+    int first_fd = 0;
+    for (size_t i = 0; i < count; i++) {
+        fds[i] = file_open(filenames[i], first_fd);
+        if (fds[i] >= 0) {
+            first_fd = fds[i] + 1;
+            opened++;
+        }
+    }
+    return opened;
+}
+
+int fs_close(int fd)
+{
+	/* TODO: Phase 3 */
+
+    if (!fat16 || !root_directory) {
+        return -1;
+    }
+
+
+
+    if (fd < 0 || fd >= FS_OPEN_MAX_COUNT || !fd_table[fd].used) {
+        return -1;
+    }
+    // Extents still point into the file
+    if (fd_table[fd].mapped != 0) {
+        return -1;
+    }
+
+    int ret = wb_flush(&fd_table[fd]);
+
+    fd_table[fd].used = 0;
+    block_buf_put(fd_table[fd].scratch);
+    fd_table[fd].scratch = NULL;
+    block_buf_put(fd_table[fd].wb_buf);
+    fd_table[fd].wb_buf = NULL;
+
+    return ret;
+
+}
+
+int fs_write_behind(int fd, int enable)
+{
+    if (!fat16 || !root_directory) {
+        return -1;
+    }
+    if (fd < 0 || fd >= FS_OPEN_MAX_COUNT || !fd_table[fd].used) {
+        return -1;
+    }
+
+    if (!enable && wb_flush(&fd_table[fd]) == -1) {
+        return -1;
+    }
+    fd_table[fd].wb_enabled = enable;
+    return 0;
+}
+
+int fs_stat(int fd)
+{
+	/* TODO: Phase 3 */
+    if (!fat16 || !root_directory) {
+        return -1;
+    }
+    if (fd < 0 || fd >= FS_OPEN_MAX_COUNT || !fd_table[fd].used) {
+        return -1;
+    }
+
+    int rootDirIndex = fd_table[fd].root_dir_index;
+
+    return root_directory[rootDirIndex].file_size;
+}
+
+int fs_lseek(int fd, size_t offset)
+{
+	/* TODO: Phase 3 */
+
+    if (!fat16 || !root_directory) {
+        return -1;
+    }
+    if (fd < 0 || fd >= FS_OPEN_MAX_COUNT || !fd_table[fd].used) {
+        return -1;
+    }
+    int rootDirIndex = fd_table[fd].root_dir_index;
+
+     if (offset > root_directory[rootDirIndex].file_size) {
+            return -1;
+     }
+
+    if (wb_flush(&fd_table[fd]) == -1) {
+        return -1;
+    }
+    fd_table[fd].offset = offset;
+
+    return 0;
+
+}
+
+// Scratch buffer of a file descriptor for the partial blocks at the edges of
+// transfers, taken from the disk layer's buffer pool on first use and given
+// back by fs_close(), so that transfers never allocate one of their own
+static void *fd_scratch(struct FileDescriptor *desc)
+{
+    if (!desc->scratch) {
+        desc->scratch = block_buf_get();
+    }
+    return desc->scratch;
+}
+
+// Data block holding file offset @offset, at most the file size, extending the
+// chain if the offset is right at the end of the file's last block. Returns 0
+// if that takes a block and the disk is full.
+static uint16_t file_block_at(int root_dir_index, size_t offset)
+{
+    uint16_t block = file_nth_block(root_dir_index, offset / BLOCK_SIZE);
+    if (block == FAT_EOC) {
+        block = allocate_new_block();
+        if (block != 0) {
+            link_new_block_to_file(root_dir_index, block);
+        }
+    }
+    return block;
+}
+
+// Position in a vector of buffers that a transfer gathers from or scatters to
+struct IoCursor
+{
+    const struct iovec *iov;    // Current buffer
+    size_t done;                // Bytes of the current buffer already transferred
+};
+
+// Skip the buffers already transferred; there must be bytes left in the vector
+static void iov_settle(struct IoCursor *cur)
+{
+    while (cur->done == cur->iov->iov_len) {
+        cur->iov++;
+        cur->done = 0;
+    }
+}
+
+// Number of bytes left in the current buffer, which can be transferred in place
+static size_t iov_contiguous(struct IoCursor *cur)
+{
+    iov_settle(cur);
+    return cur->iov->iov_len - cur->done;
+}
+
+// Take len contiguous bytes in place; iov_contiguous() must have returned at
+// least len
+static char *iov_take(struct IoCursor *cur, size_t len)
+{
+    char *p = (char *)cur->iov->iov_base + cur->done;
+
+    cur->done += len;
+    return p;
+}
+
+// Copy the next len bytes of the vector to dst
+static void iov_gather(struct IoCursor *cur, void *dst, size_t len)
+{
+    while (len != 0) {
+        size_t n = minimum(iov_contiguous(cur), len);
+        memcpy(dst, iov_take(cur, n), n);
+        dst = (char *)dst + n;
+        len -= n;
+    }
+}
+
+// Copy len bytes from src to the next bytes of the vector
+static void iov_scatter(struct IoCursor *cur, const void *src, size_t len)
+{
+    while (len != 0) {
+        size_t n = minimum(iov_contiguous(cur), len);
+        memcpy(iov_take(cur, n), src, n);
+        src = (const char *)src + n;
+        len -= n;
+    }
+}
+
+// Total length of a vector of buffers, or -1 if it is invalid or would not fit
+// in the int that transfers return
+static ssize_t iov_length(const struct iovec *iov, int iovcnt)
+{
+    size_t total = 0;
+
+    if (iovcnt < 0 || (iovcnt > 0 && iov == NULL)) {
+        return -1;
+    }
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len != 0 && iov[i].iov_base == NULL) {
+            return -1;
+        }
+        if (iov[i].iov_len > INT_MAX - total) {
+            return -1;
+        }
+        total += iov[i].iov_len;
+    }
+    return total;
+}
+
+// Write the count bytes of the vector iov at offset, at most the file size, of
+// the file open as fd, which the caller checked, leaving the file offset of fd
+// alone. The vector is one logical transfer: each block it covers is read (if
+// at all) and written once.
+static int file_write(int fd, const struct iovec *iov, size_t count, size_t offset)
+{
+    int root_dir_index = fd_table[fd].root_dir_index;
+    struct RootDirectory *dir_entry = &root_directory[root_dir_index];
+    if (count == 0) return 0; // Nothing to write
+
+    struct IoCursor cur = { iov, 0 };
+
+    size_t bytes_written = 0;
+
+    uint16_t current_block = file_block_at(root_dir_index, offset);
+
+    while (bytes_written < count && current_block != 0) {
+        char *mapped;
+        size_t block_offset = (offset + bytes_written) % BLOCK_SIZE;
+        size_t bytes_to_write = minimum(BLOCK_SIZE - block_offset, count - bytes_written);
+
+        if (bytes_to_write == BLOCK_SIZE && iov_contiguous(&cur) >= BLOCK_SIZE) {
+            // Hand a run of whole blocks to the disk layer in one request,
+            // straight from the caller's buffers
+            size_t blocks[IO_BATCH];
+            const void *bufs[IO_BATCH];
+            size_t n = 0;
+
+            for (;;) {
+                blocks[n] = current_block + superblock.data_start_index;
+                bufs[n] = iov_take(&cur, BLOCK_SIZE);
+                n++;
+                if (n == IO_BATCH || count - bytes_written - n * BLOCK_SIZE < BLOCK_SIZE
+                    || iov_contiguous(&cur) < BLOCK_SIZE) {
+                    break;
+                }
+                uint16_t next_block = next_block_alloc(root_dir_index, current_block);
+                if (next_block == 0) {
+                    break;
+                }
+                current_block = next_block;
+            }
+
+            if (cache_writev(blocks, bufs, n) == -1) {
+                break;
+            }
+            bytes_written += n * BLOCK_SIZE;
+        } else if ((mapped = data_block_map(current_block)) != NULL) {
+            // Mapped disk: modify the block in place
+            iov_gather(&cur, mapped + block_offset, bytes_to_write);
+            bytes_written += bytes_to_write;
+        } else {
+            char *scratch = fd_scratch(&fd_table[fd]);
+            if (!scratch) {
+                break;
+            }
+
+            // For partial block writes, read the block first, then modify the
+            // necessary parts, unless the write covers all of the block that
+            // lies within the file: the rest of a block past the end of the
+            // file (freshly allocated or preallocated) holds nothing to keep
+            size_t block_start = offset + bytes_written - block_offset;
+            size_t valid_end = minimum(block_start + BLOCK_SIZE, dir_entry->file_size);
+            if (block_start < dir_entry->file_size
+                && (block_offset != 0 || block_start + bytes_to_write < valid_end)) {
+                io_stats.rmw++;
+                if (cache_read(current_block + superblock.data_start_index, scratch) == -1) {
+                    break;
+                }
+            } else {
+                memset(scratch, 0, BLOCK_SIZE);
+            }
+            iov_gather(&cur, scratch + block_offset, bytes_to_write);
+            if (cache_write(current_block + superblock.data_start_index, scratch) == -1) {
+                break;
+            }
+            bytes_written += bytes_to_write;
+        }
+
+        if (bytes_written < count) {
+            current_block = next_block_alloc(root_dir_index, current_block);
+        }
+    }
+
+    // Update file size if we've written beyond the current file size
+    if (offset + bytes_written > dir_entry->file_size) {
+        dir_entry->file_size = offset + bytes_written;
+        root_dir_dirty = 1;
+    }
+
+    return bytes_written;
+}
+
+// Write-behind: small writes through fs_write() that follow each other within
+// a block are gathered in a per-descriptor buffer, and the block is written
+// once, when the buffer reaches the end of the block or when anything else
+// needs the data. The file size includes buffered bytes, and the block they go
+// to is allocated up front, so that flushing never runs out of space; every
+// other access to the file's data flushes the buffers of the file first.
+
+// Write what the write-behind buffer of a descriptor holds to the file
+static int wb_flush(struct FileDescriptor *desc)
+{
+    if (desc->wb_len == 0) {
+        return 0;
+    }
+
+    struct iovec iov = { desc->wb_buf, desc->wb_len };
+    size_t len = desc->wb_len;
+    desc->wb_len = 0;
+    if ((size_t)file_write(desc - fd_table, &iov, len, desc->wb_start) != len) {
+        return -1;
+    }
+    return 0;
+}
+
+// Flush the write-behind buffers of every descriptor open on a file, except
+// the one of except_fd (-1 for none)
+static int file_wb_flush(int root_dir_index, int except_fd)
+{
+    int ret = 0;
+
+    for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+        if (i != except_fd && fd_table[i].used && fd_table[i].wb_len != 0
+            && fd_table[i].root_dir_index == root_dir_index && wb_flush(&fd_table[i]) == -1) {
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+static int wb_flush_all(void)
+{
+    int ret = 0;
+
+    for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+        if (fd_table[i].used && wb_flush(&fd_table[i]) == -1) {
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+// Gather a write of count bytes at offset, within one block, of the file open
+// as fd into its write-behind buffer. Returns the number of bytes buffered, 0 if the write cannot be
+// buffered, or -1 on I/O error.
+static int wb_write(int fd, const void *buf, size_t count, size_t offset)
+{
+    struct FileDescriptor *desc = &fd_table[fd];
+    struct RootDirectory *dir_entry = &root_directory[desc->root_dir_index];
+    size_t block_offset = offset % BLOCK_SIZE;
+
+    if (count == 0 || count > BLOCK_SIZE - block_offset) {
+        return 0;
+    }
+    // Only writes that follow the buffered ones, in the same block
+    if (desc->wb_len != 0 && offset != desc->wb_start + desc->wb_len) {
+        return 0;
+    }
+    if (file_wb_flush(desc->root_dir_index, fd) == -1) {
+        return -1;
+    }
+
+    if (desc->wb_len == 0) {
+        if (!desc->wb_buf && !(desc->wb_buf = block_buf_get())) {
+            return 0;
+        }
+        if (file_block_at(desc->root_dir_index, offset) == 0) {
+            return 0; // Disk full, file_write() writes what it can
+        }
+        desc->wb_start = offset;
+    }
+
+    memcpy(desc->wb_buf + desc->wb_len, buf, count);
+    desc->wb_len += count;
+    if (offset + count > dir_entry->file_size) {
+        dir_entry->file_size = offset + count;
+        root_dir_dirty = 1;
+    }
+
+    // Block complete
+    if (block_offset + count == BLOCK_SIZE && wb_flush(desc) == -1) {
+        return -1;
+    }
+    return count;
+}
+
+int fs_write(int fd, void *buf, size_t count) {
+    if (!fat16 || !root_directory || !buf) {
+        return -1;
+    }
+    if (fd < 0 || fd >= FS_OPEN_MAX_COUNT || fd_table[fd].used == 0) {
+        return -1;
+    }
+
+    if (count == 0) {
+        return 0; // Nothing to write, not worth counting
+    }
+
+    struct FileDescriptor *desc = &fd_table[fd];
+    int bytes_written = 0;
+    if (desc->wb_enabled && count < BLOCK_SIZE) {
+        // A write running into the next block is buffered in two parts
+        size_t head = minimum(count, BLOCK_SIZE - desc->offset % BLOCK_SIZE);
+        bytes_written = wb_write(fd, buf, head, desc->offset);
+        if (bytes_written == (int)head && head < count) {
+            int n = wb_write(fd, buf + head, count - head, desc->offset + head);
+            if (n > 0) {
+                bytes_written += n;
+            }
+        }
+    }
+    if (bytes_written == 0) {
+        if (file_wb_flush(desc->root_dir_index, -1) == -1) {
+            return -1;
+        }
+        struct iovec iov = { buf, count };
+        bytes_written = file_write(fd, &iov, count, desc->offset);
+    }
+    if (bytes_written == -1) {
+        return -1;
+    }
+
+    // Update the file descriptor's offset
+    desc->offset += bytes_written;
+    io_stats.writes++;
+    io_stats.bytes_written += bytes_written;
+    return bytes_written;
+}
+
+int fs_pwrite(int fd, const void *buf, size_t count, size_t offset)
+{
+    if (!fat16 || !root_directory || !buf) {
+        return -1;
+    }
+    if (fd < 0 || fd >= FS_OPEN_MAX_COUNT || fd_table[fd].used == 0) {
+        return -1;
+    }
+    // Files have no holes
+    if (offset > root_directory[fd_table[fd].root_dir_index].file_size) {
+        return -1;
+    }
+    if (count == 0) {
+        return 0;
+    }
+
+    if (file_wb_flush(fd_table[fd].root_dir_index, -1) == -1) {
+        return -1;
+    }
+
+    struct iovec iov = { (void *)buf, count };
+    int bytes_written = file_write(fd, &iov, count, offset);
+    io_stats.writes++;
+    io_stats.bytes_written += bytes_written;
+    return bytes_written;
+}
+
+int fs_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+    if (!fat16 || !root_directory) {
+        return -1;
+    }
+    if (fd < 0 || fd >= FS_OPEN_MAX_COUNT || fd_table[fd].used == 0) {
+        return -1;
+    }
+    ssize_t count = iov_length(iov, iovcnt);
+    if (count == -1) {
+        return -1;
+    }
+    if (count == 0) {
+        return 0;
+    }
+
+    if (file_wb_flush(fd_table[fd].root_dir_index, -1) == -1) {
+        return -1;
+    }
+
+    int bytes_written = file_write(fd, iov, count, fd_table[fd].offset);
+    fd_table[fd].offset += bytes_written;
+    io_stats.writes++;
+    io_stats.bytes_written += bytes_written;
+    return bytes_written;
+}
+
+// Check whether file block @idx, at disk block @block, was prefetched and is
+// still in the cache now that the reader gets to it
+static void readahead_account(struct FileDescriptor *desc, size_t idx, size_t block,
+                              size_t *hits, size_t *misses)
+{
+    if (idx >= desc->ra_end) {
+        return; // Never prefetched
+    }
+    if (cache_contains(block)) {
+        (*hits)++;
+    } else {
+        (*misses)++;
+    }
+}
+
+// Prefetch the blocks following file block @last_idx (data block @last_blk),
+// up to the descriptor's readahead window, by walking the FAT ahead of the reader
+static void readahead(struct FileDescriptor *desc, size_t last_idx, uint16_t last_blk)
+{
+    size_t blocks[RA_MAX_WINDOW];
+    size_t n = 0;
+    size_t idx = last_idx + 1;
+    size_t end = last_idx + 1 + desc->ra_window;
+    uint16_t blk = fat16[last_blk];
+
+    // Skip what earlier reads already prefetched
+    while (idx < end && idx < desc->ra_end && blk != FAT_EOC) {
+        blk = fat16[blk];
+        idx++;
+    }
+
+    size_t first_idx = idx;
+    while (idx < end && blk != FAT_EOC) {
+        blocks[n++] = blk + superblock.data_start_index;
+        blk = fat16[blk];
+        idx++;
+    }
+    if (n == 0) {
+        return;
+    }
+
+    // The cache may take fewer blocks than asked for, or none when disabled
+    int loaded = cache_prefetch(blocks, n);
+    if (loaded > 0) {
+        desc->ra_end = first_idx + loaded;
+    }
+}
+
+// Read up to count bytes at offset of the file open as fd, which the caller
+// checked, into the vector iov, leaving the file offset of fd alone
+static int file_read(int fd, const struct iovec *iov, size_t count, size_t offset)
+{
+    int root_dir_index = fd_table[fd].root_dir_index;
+    struct RootDirectory *dir_entry = &root_directory[root_dir_index];
+    if (count == 0 || offset >= dir_entry->file_size) return 0; // Nothing can be read
+    if (file_wb_flush(root_dir_index, -1) == -1) return -1;
+    count = minimum(count, dir_entry->file_size - offset);
+
+    // Reads picking up where the previous one stopped are sequential, anything
+    // else drops the readahead window
+    struct FileDescriptor *desc = &fd_table[fd];
+    if (offset != desc->ra_next) {
+        desc->ra_window = 0;
+        desc->ra_end = 0;
+    } else if (desc->ra_window == 0) {
+        desc->ra_window = RA_MIN_WINDOW;
+    }
+    size_t ra_hits = 0, ra_misses = 0;
+
+    struct IoCursor cur = { iov, 0 };
+    size_t bytes_read = 0;
+    size_t read_idx = offset / BLOCK_SIZE;
+    uint16_t read_blk = file_nth_block(root_dir_index, read_idx);
+    uint16_t last_blk = FAT_EOC;
+
+    while (bytes_read < count && read_blk != FAT_EOC) {
+        char *mapped;
+        size_t block_offset = (offset + bytes_read) % BLOCK_SIZE;
+        size_t bytes_to_read = minimum(BLOCK_SIZE - block_offset, count - bytes_read);
+
+        if (bytes_to_read == BLOCK_SIZE && iov_contiguous(&cur) >= BLOCK_SIZE) {
+            // Whole blocks go straight into the caller's buffers, a run of
+            // them at a time
+            size_t blocks[IO_BATCH];
+            void *bufs[IO_BATCH];
+            size_t n = 0;
+
+            for (;;) {
+                blocks[n] = read_blk + superblock.data_start_index;
+                bufs[n] = iov_take(&cur, BLOCK_SIZE);
+                readahead_account(desc, read_idx + n, blocks[n], &ra_hits, &ra_misses);
+                n++;
+                if (n == IO_BATCH || count - bytes_read - n * BLOCK_SIZE < BLOCK_SIZE
+                    || fat16[read_blk] == FAT_EOC || iov_contiguous(&cur) < BLOCK_SIZE) {
+                    break;
+                }
+                read_blk = fat16[read_blk]; // Advance to the next block
+            }
+            read_idx += n - 1;
+
+            if (cache_readv(blocks, bufs, n) == -1) {
+                break;
+            }
+            bytes_read += n * BLOCK_SIZE;
+        } else if ((mapped = data_block_map(read_blk)) != NULL) {
+            // Mapped disk: copy straight out of the block
+            iov_scatter(&cur, mapped + block_offset, bytes_to_read);
+            bytes_read += bytes_to_read;
+        } else {
+            char *scratch = fd_scratch(desc);
+            if (!scratch) {
+                break;
+            }
+            readahead_account(desc, read_idx, read_blk + superblock.data_start_index,
+                              &ra_hits, &ra_misses);
+            if (cache_read(read_blk + superblock.data_start_index, scratch) == -1) {
+                break;
+            }
+            iov_scatter(&cur, scratch + block_offset, bytes_to_read);
+            bytes_read += bytes_to_read;
+        }
+
+        last_blk = read_blk;
+        read_blk = fat16[read_blk]; // Get the next block in the file's data block chain
+        read_idx++;
+    }
+
+    io_stats.reads++;
+    io_stats.bytes_read += bytes_read;
+
+    if (desc->ra_window != 0 && last_blk != FAT_EOC) {
+        // Prefetched blocks that got evicted before the reader reached them
+        // were wasted: back off. Otherwise the reader keeps up, run further ahead.
+        if (ra_misses != 0) {
+            desc->ra_window = maximum(desc->ra_window / 2, RA_MIN_WINDOW);
+        } else if (ra_hits != 0) {
+            // Never prefetch more than half of the cache ahead
+            desc->ra_window = minimum(desc->ra_window * 2,
+                                      minimum(RA_MAX_WINDOW, cache_blocks / 2));
+        }
+        readahead(desc, read_idx - 1, last_blk);
+    }
+    desc->ra_next = offset + bytes_read;
+
+    return bytes_read; // Return the number of bytes actually read
+}
+
+int fs_read(int fd, void *buf, size_t count) {
+    if (!fat16 || !root_directory || !buf) {
+        return -1;
+    }
+    if (fd < 0 || fd >= FS_OPEN_MAX_COUNT || fd_table[fd].used == 0) {
+        return -1;
+    }
+
+    struct iovec iov = { buf, count };
+    int bytes_read = file_read(fd, &iov, count, fd_table[fd].offset);
+    if (bytes_read == -1) {
+        return -1;
+    }
+    fd_table[fd].offset += bytes_read; // Update file offset
+    return bytes_read;
+}
+
+int fs_pread(int fd, void *buf, size_t count, size_t offset)
+{
+    if (!fat16 || !root_directory || !buf) {
+        return -1;
+    }
+    if (fd < 0 || fd >= FS_OPEN_MAX_COUNT || fd_table[fd].used == 0) {
+        return -1;
+    }
+
+    struct iovec iov = { buf, count };
+    return file_read(fd, &iov, count, offset);
+}
+
+int fs_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+    if (!fat16 || !root_directory) {
+        return -1;
+    }
+    if (fd < 0 || fd >= FS_OPEN_MAX_COUNT || fd_table[fd].used == 0) {
+        return -1;
+    }
+    ssize_t count = iov_length(iov, iovcnt);
+    if (count == -1) {
+        return -1;
+    }
+
+    int bytes_read = file_read(fd, iov, count, fd_table[fd].offset);
+    if (bytes_read == -1) {
+        return -1;
+    }
+    fd_table[fd].offset += bytes_read;
+    return bytes_read;
+}
+
+// Extents point straight into the memory-mapped disk image, whose consecutive
+// blocks are contiguous, or else into cache slots pinned until fs_unmap()
+int fs_map(int fd, size_t offset, size_t count, struct fs_extent *extents, int max_extents)
+{
+    if (!fat16 || !root_directory || !extents) {
+        return -1;
+    }
+    if (fd < 0 || fd >= FS_OPEN_MAX_COUNT || fd_table[fd].used == 0) {
+        return -1;
+    }
+
+    struct FileDescriptor *desc = &fd_table[fd];
+    int root_dir_index = desc->root_dir_index;
+    size_t file_size = root_directory[root_dir_index].file_size;
+    if (offset >= file_size || count == 0 || max_extents <= 0) {
+        return 0;
+    }
+    count = minimum(count, file_size - offset);
+    if (file_wb_flush(root_dir_index, -1) == -1) {
         return -1;
     }
 
-    for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-        if (strcmp(root_directory[i].filename, filename) == 0) {
+    uint16_t blk = file_nth_block(root_dir_index, offset / BLOCK_SIZE);
+    int in_place = block_map(0) != NULL;
+    if (!in_place) {
+        // Load what is missing with one request rather than a block at a time
+        size_t blocks[IO_BATCH];
+        size_t n = 0;
+        size_t want = (offset % BLOCK_SIZE + count + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        for (uint16_t b = blk; b != FAT_EOC && n < minimum(want, IO_BATCH); b = fat16[b]) {
+            blocks[n++] = b + superblock.data_start_index;
+        }
+        if (n != 0 && cache_prefetch(blocks, n) == -1) {
             return -1;
         }
-    }   
+    }
 
-    int index = -1;
-    for (int i = 0; i < FS_FILE_MAX_COUNT; ++i) 
-    {
-        if (root_directory[i].filename[0] == '\0') 
-        {
-            index = i;
+    int n = 0;
+    size_t done = 0;
+    while (done < count && blk != FAT_EOC) {
+        size_t block_offset = (offset + done) % BLOCK_SIZE;
+        size_t len = minimum(BLOCK_SIZE - block_offset, count - done);
+        char *data = in_place ? data_block_map(blk)
+                              : cache_pin(blk + superblock.data_start_index);
+        if (data == NULL) {
+            break; // Out of cache slots to pin
+        }
+        data += block_offset;
+
+        if (n != 0 && (const char *)extents[n - 1].data + extents[n - 1].len == data) {
+            extents[n - 1].len += len;
+        } else if (n < max_extents) {
+            extents[n].data = data;
+            extents[n].len = len;
+            n++;
+        } else {
+            if (!in_place) {
+                cache_unpin(data);
+            }
             break;
         }
+        done += len;
+        blk = fat16[blk];
     }
 
-    // Check if the root directory is full
-    if (index == -1) {
+    if (n == 0) {
         return -1;
     }
-
-    strncpy(root_directory[index].filename, filename, FS_FILENAME_LEN);
-    root_directory[index].file_size = 0;
-    root_directory[index].first_data_block = FAT_EOC;
-
-    return 0;
+    desc->mapped += n;
+    return n;
 }
 
-int fs_delete(const char *filename)
+int fs_unmap(int fd, const struct fs_extent *extents, int count)
 {
-	/* TODO: Phase 2 */
-    if (!fat16 || !root_directory) {
+    if (!fat16 || !root_directory || (count != 0 && !extents)) {
         return -1;
     }
-
-    if (filename == NULL || strlen(filename) == 0 || strlen(filename) > FS_FILENAME_LEN) {
+    if (fd < 0 || fd >= FS_OPEN_MAX_COUNT || fd_table[fd].used == 0) {
         return -1;
     }
-    int index = -1;
-    for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-        if (strcmp(root_directory[i].filename, filename) == 0) {
-            index = i;
-            break;
-        }
-    }
-
-    if (index == -1){
+    if (count < 0 || (size_t)count > fd_table[fd].mapped) {
         return -1;
     }
 
-// cccchhh
-    for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-    if (fd_table[i].used && fd_table[i].root_dir_index == index) {
-        return -1;  // File is currently open
+    if (block_map(0) == NULL) {
+        // Each block of an extent is a slot pinned once, and slots are
+        // aligned on BLOCK_SIZE
+        for (int i = 0; i < count; i++) {
+            const char *p = extents[i].data;
+            const char *end = p + extents[i].len;
+            while (p < end) {
+                cache_unpin(p);
+                p += BLOCK_SIZE - (uintptr_t)p % BLOCK_SIZE;
+            }
+        }
     }
+    fd_table[fd].mapped -= count;
+    return 0;
+}
+
+// Number of blocks in the chain of a file
+static size_t file_chain_length(int root_dir_index)
+{
+    if (file_tails[root_dir_index] == FAT_EOC) {
+        return 0;
     }
 
-    uint16_t block_index = root_directory[index].first_data_block;
-    while (block_index != FAT_EOC) {
-        uint16_t next_block_index = fat16[block_index];
-        fat16[block_index] = 0; 
-        block_index = next_block_index;
+    // Use the block map if it already covers the whole chain, but don't build
+    // it just for this: listing the directory would map every file
+    const struct BlockMap *map = &block_maps[root_dir_index];
+    if (map->count && map->blocks[map->count - 1] == file_tails[root_dir_index]) {
+        return map->count;
     }
 
-    memset(&root_directory[index], 0, sizeof(struct RootDirectory));
+    size_t length = 0;
+    for (uint16_t block = root_directory[root_dir_index].first_data_block;
+         block != FAT_EOC; block = fat16[block]) {
+        length++;
+    }
+    return length;
+}
 
-    return 0;
+// Cut the chain of a file after its first @keep blocks and release the rest
+// in one walk
+static void file_chain_cut(int root_dir_index, size_t keep)
+{
+    struct RootDirectory *dir_entry = &root_directory[root_dir_index];
+    uint16_t last = keep ? file_nth_block(root_dir_index, keep - 1) : FAT_EOC;
+    uint16_t block = keep ? fat16[last] : dir_entry->first_data_block;
+
+    while (block != FAT_EOC) {
+        uint16_t next = fat16[block];
+        fat_set(block, 0);
+        block = next;
+    }
+    if (keep) {
+        fat_set(last, FAT_EOC);
+    } else {
+        dir_entry->first_data_block = FAT_EOC;
+        root_dir_dirty = 1;
+    }
+    file_tails[root_dir_index] = last;
+    if (block_maps[root_dir_index].count > keep) {
+        block_maps[root_dir_index].count = keep;
+    }
 }
 
-int fs_ls(void)
+int fs_fallocate(int fd, size_t length)
 {
-    if (!fat16 || !root_directory)
-    {
+    if (!fat16 || !root_directory) {
+        return -1;
+    }
+    if (fd < 0 || fd >= FS_OPEN_MAX_COUNT || fd_table[fd].used == 0) {
         return -1;
     }
 
-    // Iterate through root directory entries and print information about each file
-    for (int i = 0; i < FS_FILE_MAX_COUNT; ++i)
-    {
-        if (root_directory[i].filename[0] != '\0')
-        { // Check if entry is not empty
-            printf("file: %s, size: %d, data_blk: %d\n",
-                   root_directory[i].filename,
-                   root_directory[i].file_size,
-                   root_directory[i].first_data_block);
+    int root_dir_index = fd_table[fd].root_dir_index;
+    size_t wanted = (length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    size_t have = file_chain_length(root_dir_index);
+    if (wanted <= have) {
+        return 0; // Already allocated
+    }
+
+    size_t missing = wanted - have;
+    if (missing > free_count) {
+        return -1;
+    }
+
+    while (missing > 0) {
+        uint16_t start;
+        size_t run;
+        uint16_t tail = file_tails[root_dir_index];
+
+        // Carry on right after the file's last block if possible, otherwise
+        // take the first run long enough, or the longest one
+        if (tail != FAT_EOC && data_block_free(tail + 1)) {
+            start = tail + 1;
+            run = 1;
+            while (run < missing && data_block_free(start + run)) {
+                run++;
+            }
+        } else {
+            run = free_run_find(missing, &start);
+            if (run == 0) {
+                // Out of space although free_count said otherwise, give
+                // back the blocks linked so far
+                file_chain_cut(root_dir_index, have);
+                return -1;
+            }
+        }
+        run = minimum(run, missing);
+
+        for (size_t i = 0; i < run; i++) {
+            link_new_block_to_file(root_dir_index, start + i);
         }
+        missing -= run;
     }
+
     return 0;
 }
 
-int fs_open(const char *filename)
+int fs_truncate(int fd, size_t length)
 {
-	/* TODO: Phase 3 */
     if (!fat16 || !root_directory) {
         return -1;
     }
-    if (filename == NULL || strlen(filename) == 0 || strlen(filename) > FS_FILENAME_LEN) {
+    if (fd < 0 || fd >= FS_OPEN_MAX_COUNT || fd_table[fd].used == 0) {
         return -1;
     }
-    int index = -1;
-    for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-        if (strcmp(root_directory[i].filename, filename) == 0) {
-            index = i;
-            break;
-        }
-    }
-    if (index == -1){
+    if (length > UINT32_MAX) {
         return -1;
     }
-    int fd = -1;
-    for (int i = 0; i < FS_OPEN_MAX_COUNT; ++i) {
-        if (fd_table[i].used == 0) {
-            fd = i;
-            break;
-        }
+
+    int root_dir_index = fd_table[fd].root_dir_index;
+    if (file_is_mapped(root_dir_index)) {
+        return -1; // Extents could be left pointing at freed blocks
     }
-    if (fd == -1) {
+    struct RootDirectory *dir_entry = &root_directory[root_dir_index];
+    if (file_wb_flush(root_dir_index, -1) == -1) {
+        return -1;
+    }
+
+    if (length > dir_entry->file_size) {
+        // Allocate every block first, so that running out of space changes
+        // nothing, then zero the new bytes. Blocks past the end of the file
+        // are zero-filled by file_write() without being read first.
+        static char zero_block[BLOCK_SIZE] __attribute__((aligned(BLOCK_SIZE)));
+        struct iovec iov[IO_BATCH];
+
+        if (fs_fallocate(fd, length) == -1) {
             return -1;
+        }
+        for (size_t i = 0; i < IO_BATCH; i++) {
+            iov[i].iov_base = zero_block;
+            iov[i].iov_len = BLOCK_SIZE;
+        }
+
+        // Finish the last block first, so that the rest goes out as whole blocks
+        size_t count = minimum(length - dir_entry->file_size,
+                               (BLOCK_SIZE - dir_entry->file_size % BLOCK_SIZE) % BLOCK_SIZE);
+        while (dir_entry->file_size < length) {
+            if (count == 0) {
+                count = minimum(length - dir_entry->file_size, IO_BATCH * BLOCK_SIZE);
+            }
+            if ((size_t)file_write(fd, iov, count, dir_entry->file_size) != count) {
+                return -1;
+            }
+            count = 0;
+        }
+        return 0;
     }
-fd_table[fd].used = 1;
-fd_table[fd].root_dir_index = fd;
-fd_table[fd].offset = 0;
 
-return fd;
+    // Release the blocks past the ones the new length needs, preallocated
+    // blocks included
+    file_chain_cut(root_dir_index, (length + BLOCK_SIZE - 1) / BLOCK_SIZE);
 
+    dir_entry->file_size = length;
+    root_dir_dirty = 1;
 
+    // Descriptors open on the file must not point past its end, and what they
+    // prefetched may be gone
+    for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+        if (fd_table[i].used && fd_table[i].root_dir_index == root_dir_index) {
+            fd_table[i].offset = minimum(fd_table[i].offset, length);
+            fd_table[i].ra_end = 0;
+            fd_table[i].ra_window = 0;
+        }
+    }
+    return 0;
 }
 
-int fs_close(int fd)
+// Number of runs of contiguous data blocks in the chain of a file
+static int file_fragments(int root_dir_index)
 {
-	/* TODO: Phase 3 */
+    int runs = 0;
+    uint16_t prev = FAT_EOC;
+
+    for (uint16_t block = root_directory[root_dir_index].first_data_block;
+         block != FAT_EOC; block = fat16[block]) {
+        if (prev == FAT_EOC || block != prev + 1) {
+            runs++;
+        }
+        prev = block;
+    }
+    return runs;
+}
 
+int fs_frag_ls(void)
+{
     if (!fat16 || !root_directory) {
         return -1;
     }
 
+    for (int i = 0; i < FS_FILE_MAX_COUNT; ++i) {
+        if (root_directory[i].filename[0] != '\0') {
+            printf("file: %s, data_blk_count: %zu, fragments: %d\n",
+                   root_directory[i].filename,
+                   file_chain_length(i),
+                   file_fragments(i));
+        }
+    }
+    return 0;
+}
+
+static void dirent_fill(int root_dir_index, struct fs_dirent *dirent)
+{
+    const struct RootDirectory *entry = &root_directory[root_dir_index];
 
+    memcpy(dirent->filename, entry->filename, FS_FILENAME_LEN);
+    dirent->filename[FS_FILENAME_LEN - 1] = '\0';
+    dirent->size = entry->file_size;
+    dirent->first_block = entry->first_data_block;
+    dirent->block_count = file_chain_length(root_dir_index);
+}
 
-    if (fd < 0 || fd >= FS_OPEN_MAX_COUNT || !fd_table[fd].used) {
+int fs_readdir(size_t *pos, struct fs_dirent *dirent)
+{
+    if (!fat16 || !root_directory || !pos || !dirent) {
         return -1;
     }
 
-
-    fd_table[fd].used = 0;
-
+    for (size_t i = *pos; i < FS_FILE_MAX_COUNT; i++) {
+        if (root_directory[i].filename[0] != '\0') {
+            dirent_fill(i, dirent);
+            *pos = i + 1;
+            return 1;
+        }
+    }
+    *pos = FS_FILE_MAX_COUNT;
     return 0;
-
 }
 
-int fs_stat(int fd)
+int fs_stat_name(const char *filename, struct fs_dirent *dirent)
 {
-	/* TODO: Phase 3 */
-    if (!fat16 || !root_directory) {
+    if (!fat16 || !root_directory || !dirent) {
         return -1;
     }
-    if (fd < 0 || fd >= FS_OPEN_MAX_COUNT || !fd_table[fd].used) {
+    if (!filename_valid(filename)) {
         return -1;
     }
 
-    int rootDirIndex = fd_table[fd].root_dir_index;
-
-    return root_directory[rootDirIndex].file_size;
+    int index = name_lookup(filename);
+    if (index == -1) {
+        return -1;
+    }
+    dirent_fill(index, dirent);
+    return 0;
 }
 
-int fs_lseek(int fd, size_t offset)
+// Move @n blocks of a file, from file block @first on, to the free data
+// blocks @dest onwards, and put them in place of the old ones in the chain
+static int defrag_move(int root_dir_index, size_t first, size_t n, uint16_t dest, char *buf)
 {
-	/* TODO: Phase 3 */
+    uint16_t old[IO_BATCH];
+    size_t old_blocks[IO_BATCH], new_blocks[IO_BATCH];
+    void *bufs[IO_BATCH];
+
+    for (size_t j = 0; j < n; j++) {
+        old[j] = file_nth_block(root_dir_index, first + j);
+        old_blocks[j] = old[j] + superblock.data_start_index;
+        new_blocks[j] = dest + j + superblock.data_start_index;
+        bufs[j] = buf + j * BLOCK_SIZE;
+    }
 
-    if (!fat16 || !root_directory) {
+    // Copy the data first, through the cache which may hold newer content
+    if (cache_readv(old_blocks, bufs, n) == -1
+        || cache_writev(new_blocks, (const void *const *)bufs, n) == -1) {
         return -1;
     }
-    if (fd < 0 || fd >= FS_OPEN_MAX_COUNT || !fd_table[fd].used) {
-        return -1;
+
+    uint16_t after = fat16[old[n - 1]];
+    for (size_t j = 0; j < n; j++) {
+        fat_set(dest + j, j + 1 < n ? dest + j + 1 : after);
+    }
+    if (first == 0) {
+        root_directory[root_dir_index].first_data_block = dest;
+        root_dir_dirty = 1;
+    } else {
+        fat_set(file_nth_block(root_dir_index, first - 1), dest);
+    }
+    if (after == FAT_EOC) {
+        file_tails[root_dir_index] = dest + n - 1;
     }
-    int rootDirIndex = fd_table[fd].root_dir_index;
 
-     if (offset > root_directory[rootDirIndex].file_size) {
-            return -1;
-     }
+    struct BlockMap *map = &block_maps[root_dir_index];
+    for (size_t j = 0; j < n; j++) {
+        fat_set(old[j], 0);
+        if (first + j < map->count) {
+            map->blocks[first + j] = dest + j;
+        }
+    }
+    return 0;
+}
 
-    fd_table[fd].offset = offset;
+// Make the blocks of a file from file block *@next on contiguous, moving at
+// most @budget blocks. Return the number of blocks moved, or -1 on error;
+// *@next is left at the first block not handled yet.
+static long defrag_file(int root_dir_index, size_t *next, size_t budget, char *buf)
+{
+    size_t count = file_chain_length(root_dir_index);
+    size_t i = *next;
+    size_t moved = 0;
+
+    while (i < count && moved < budget) {
+        uint16_t prev = i ? file_nth_block(root_dir_index, i - 1) : FAT_EOC;
+        uint16_t block = file_nth_block(root_dir_index, i);
+        if (prev != FAT_EOC && block == prev + 1) {
+            i++; // Already in place
+            continue;
+        }
 
-    return 0;
+        uint16_t dest;
+        size_t run;
+        if (prev != FAT_EOC && data_block_free(prev + 1)) {
+            // Grow the run the previous blocks are in
+            dest = prev + 1;
+            run = 1;
+            while (run < count - i && data_block_free(dest + run)) {
+                run++;
+            }
+        } else {
+            // Move the rest of the file as a whole, unless it already is in
+            // one piece. If there is no room for it in one piece, leave this
+            // fragment where it is and try again after it.
+            size_t j = i + 1;
+            while (j < count && file_nth_block(root_dir_index, j)
+                                == file_nth_block(root_dir_index, j - 1) + 1) {
+                j++;
+            }
+            if (j == count) {
+                i = count;
+                break;
+            }
+            run = free_run_find(count - i, &dest);
+            if (run < count - i) {
+                i = j;
+                continue;
+            }
+        }
+
+        size_t n = minimum(minimum(run, count - i), minimum(budget - moved, IO_BATCH));
+        if (defrag_move(root_dir_index, i, n, dest, buf) == -1) {
+            return -1;
+        }
+        moved += n;
+        i += n;
+    }
 
+    *next = i;
+    return moved;
 }
 
-int fs_write(int fd, void *buf, size_t count) {
-    if (!fat16 || !root_directory || !buf) {
+int fs_defrag(size_t max_blocks)
+{
+    if (!fat16 || !root_directory) {
         return -1;
     }
-    if (fd < 0 || fd >= FS_OPEN_MAX_COUNT || fd_table[fd].used == 0) {
-        return -1;
+    if (max_blocks == 0) {
+        max_blocks = SIZE_MAX;
     }
 
-    struct RootDirectory *dir_entry = &root_directory[fd_table[fd].root_dir_index];
-    if (count == 0) return 0; // Nothing to write
+    char *buf = malloc(IO_BATCH * BLOCK_SIZE);
+    if (!buf) {
+        return -1;
+    }
 
-    size_t offset = fd_table[fd].offset;
-    size_t bytes_written = 0;
-    void *bounce_buffer = malloc(BLOCK_SIZE);
-    if (!bounce_buffer) return -1; // Failed to allocate memory
-
-    while (bytes_written < count) {
-        // Calculate the block to write to, based on the current offset
-        uint16_t current_block = get_offset_blk(fd, offset + bytes_written);
-        if (current_block == FAT_EOC || current_block == 0) {
-            // Allocate a new block if necessary
-            current_block = allocate_new_block();
-            if (current_block == 0) break; // No more space on disk
-
-            // Update FAT to link this new block to the file
-            if (offset == dir_entry->file_size) {
-                // Link new block at the end of the file
-                link_new_block_to_file(fd_table[fd].root_dir_index, current_block);
+    size_t moved = 0;
+    while (defrag_entry < FS_FILE_MAX_COUNT && moved < max_blocks) {
+        // Moving the blocks of a mapped file would leave its extents pointing
+        // at freed blocks, leave it for the next pass
+        if (root_directory[defrag_entry].filename[0] != '\0' &&
+            !file_is_mapped(defrag_entry)) {
+            long n = defrag_file(defrag_entry, &defrag_block, max_blocks - moved, buf);
+            if (n == -1) {
+                free(buf);
+                return -1;
+            }
+            moved += n;
+            if (defrag_block < file_chain_length(defrag_entry)) {
+                continue; // Out of budget in the middle of the file
             }
         }
-
-        size_t block_offset = (offset + bytes_written) % BLOCK_SIZE;
-        size_t bytes_to_write = minimum(BLOCK_SIZE - block_offset, count - bytes_written);
-
-        // For partial block writes, read the block first, then modify the necessary parts
-        if (block_offset != 0 || bytes_to_write != BLOCK_SIZE) {
-            block_read(current_block + superblock.data_start_index, bounce_buffer);
-        }
-        memcpy(bounce_buffer + block_offset, buf + bytes_written, bytes_to_write);
-        block_write(current_block + superblock.data_start_index, bounce_buffer);
-
-        bytes_written += bytes_to_write;
+        defrag_entry++;
+        defrag_block = 0;
     }
+    free(buf);
 
-    // Update file size if we've written beyond the current file size
-    if (offset + bytes_written > dir_entry->file_size) {
-        dir_entry->file_size = offset + bytes_written;
-        // This assumes you have a way to write back the updated root directory entry to disk
+    if (defrag_entry < FS_FILE_MAX_COUNT) {
+        return 1;
     }
+    // Pass complete, the next call starts over
+    defrag_entry = 0;
+    return 0;
+}
 
-    // Update the file descriptor's offset
-    fd_table[fd].offset += bytes_written;
+int fs_cache_config(size_t nblocks, int policy)
+{
+    if (fat16 || root_directory) {
+        return -1;
+    }
+    if (policy != FS_CACHE_CLOCK && policy != FS_CACHE_LRU) {
+        return -1;
+    }
 
-    free(bounce_buffer);
-    return bytes_written;
+    cache_blocks = nblocks;
+    cache_policy = policy == FS_CACHE_LRU ? CACHE_LRU : CACHE_CLOCK;
+    return 0;
 }
 
-int fs_read(int fd, void *buf, size_t count) {
-    if (!fat16 || !root_directory || !buf) {
+int fs_aio_config(unsigned depth)
+{
+    if (fat16 || root_directory) {
         return -1;
     }
-    if (fd < 0 || fd >= FS_OPEN_MAX_COUNT || fd_table[fd].used == 0) {
+
+    aio_depth = depth;
+    return 0;
+}
+
+int fs_cache_stats(size_t *hits, size_t *misses)
+{
+    cache_stats(hits, misses);
+    return 0;
+}
+
+int fs_stats(struct fs_stats *stats)
+{
+    if (!stats) {
         return -1;
     }
 
+    *stats = io_stats;
+    cache_stats(&stats->cache_hits, &stats->cache_misses);
 
-    struct RootDirectory *dir_entry = &root_directory[fd_table[fd].root_dir_index];
-    size_t offset = fd_table[fd].offset;
-    int32_t real_count = clamp(dir_entry->file_size - offset, 0, count); // Assuming clamp function limits between 0 and count
-    if (real_count == 0) return 0;
-
-    uint16_t read_blk = get_offset_blk(fd, offset);
-    if (read_blk == 0) return -1; // Nothing can be read
-
-    void *bounce_buffer = malloc(BLOCK_SIZE);
-    memset(bounce_buffer, 0, BLOCK_SIZE);
-    int buf_idx = 0;
-    block_read(read_blk + superblock.data_start_index, bounce_buffer); // Assuming superblock has data_start_index field
-    memcpy(buf + buf_idx, bounce_buffer, clamp(real_count, 0, BLOCK_SIZE));
-
-    buf_idx += clamp(real_count, 0, BLOCK_SIZE);
-    real_count -= BLOCK_SIZE; // Remaining bytes to read
-    read_blk = fat16[read_blk]; // Get the next block in the file's data block chain
-
-    while (real_count > 0 && read_blk != FAT_EOC) {
-        if (real_count >= BLOCK_SIZE) {
-            block_read(read_blk + superblock.data_start_index, buf + buf_idx);
-            buf_idx += BLOCK_SIZE;
-        } else {
-            block_read(read_blk + superblock.data_start_index, bounce_buffer);
-            memcpy(buf + buf_idx, bounce_buffer, real_count);
-            buf_idx += real_count; // This increment is actually unnecessary
+    // Add the transfers of the disk mounted right now
+    if (fat16 && root_directory) {
+        struct block_stats disk_stats;
+        if (block_stats(&disk_stats) == 0) {
+            io_stats_add(&stats->disk_reads, &disk_stats.read);
+            io_stats_add(&stats->disk_writes, &disk_stats.write);
         }
-        real_count -= BLOCK_SIZE;
-        read_blk = fat16[read_blk]; // Advance to the next block
     }
-
-    free(bounce_buffer);
-    fd_table[fd].offset += (count - real_count); // Update file offset
-
-    return (count - real_count); // Return the number of bytes actually read
+    return 0;
 }
 
 uint16_t allocate_new_block(void) {
-    // Implementation for finding a free block in the FAT and marking it as used
-    for (uint16_t i = 0; i < superblock.data_blocks; i++) {
-        if (fat16[i] == 0) { // 0 indicates a free block
-            fat16[i] = FAT_EOC; // Mark as end of chain (or use another value to continue the chain)
-            return i + superblock.data_start_index; // Return the actual block index on disk
-        }
+    // Take a free block from the free block index and mark it as used
+    uint16_t i = free_map_find();
+    if (i == 0) {
+        return 0; // Indicate no free blocks are available
     }
-    return 0; // Indicate no free blocks are available
+    fat_set(i, FAT_EOC); // Mark as end of chain (or use another value to continue the chain)
+    return i; // Return the FAT index, the block is at data_start_index + i on disk
 }
 
 size_t minimum(size_t a, size_t b) {
@@ -493,6 +2223,14 @@ size_t minimum(size_t a, size_t b) {
     }
 }
 
+size_t maximum(size_t a, size_t b) {
+    if (a > b) {
+        return a;
+    } else {
+        return b;
+    }
+}
+
 uint16_t get_offset_blk(int fd, size_t offset) {
     if (!fat16 || !root_directory) {
         return -1;
@@ -507,15 +2245,59 @@ uint16_t get_offset_blk(int fd, size_t offset) {
         return 0; // Offset is larger than file size
     }
 
-    int block_count = file_blk_count(offset);
-    uint16_t current_block = dir_entry->first_data_block;
-    for (int i = 1; i < block_count; ++i) { // Navigate to the correct block
+    return file_nth_block(fd_table[fd].root_dir_index, offset / BLOCK_SIZE);
+}
+
+uint16_t file_nth_block(int root_dir_index, size_t n) {
+    struct BlockMap *map = &block_maps[root_dir_index];
+    if (n < map->count) {
+        return map->blocks[n];
+    }
+
+    // Extend the map along the chain, from the last block mapped so far
+    uint16_t current_block = map->count ? fat16[map->blocks[map->count - 1]]
+                                        : root_directory[root_dir_index].first_data_block;
+    while (map->count <= n && current_block != FAT_EOC) {
+        if (map->count == map->capacity) {
+            size_t capacity = map->capacity ? map->capacity * 2 : 16;
+            uint16_t *blocks = realloc(map->blocks, capacity * sizeof(uint16_t));
+            if (!blocks) {
+                break; // Walk the rest of the way without the map
+            }
+            map->blocks = blocks;
+            map->capacity = capacity;
+        }
+        map->blocks[map->count++] = current_block;
+        current_block = fat16[current_block];
+    }
+    if (n < map->count) {
+        return map->blocks[n];
+    }
+
+    for (size_t i = map->count; i < n && current_block != FAT_EOC; ++i) { // Navigate to the correct block
         current_block = fat16[current_block];
     }
 
     return current_block;
 }
 
+uint16_t next_block_alloc(int root_dir_index, uint16_t block) {
+    if (fat16[block] != FAT_EOC) {
+        return fat16[block];
+    }
+
+    uint16_t new_block = allocate_new_block();
+    if (new_block != 0) {
+        fat_set(block, new_block); // Link the new block after the current last one
+        file_tails[root_dir_index] = new_block;
+    }
+    return new_block;
+}
+
+char *data_block_map(uint16_t block) {
+    return block_map(block + superblock.data_start_index);
+}
+
 int file_blk_count(uint32_t sz) {
     if (sz == 0) return 1;
     
@@ -523,47 +2305,30 @@ int file_blk_count(uint32_t sz) {
     return (blocks * BLOCK_SIZE < sz) ? (blocks + 1) : blocks;
 }
 
-static inline int32_t clamp(int32_t val, int32_t min, int32_t max) {
-    if (val < min) return min;
-    if (val > max) return max;
-    return val;
-}
-
 void expand_file(int fd, size_t new_size) {
     struct RootDirectory *dir_entry = &root_directory[fd_table[fd].root_dir_index];
     while (dir_entry->file_size < new_size) {
         uint16_t new_block = allocate_new_block();
-        if (new_block == FAT_EOC) break; // No space left, stop expanding
-        
-        // If the file has no blocks yet, initialize first_data_block
-        if (dir_entry->first_data_block == FAT_EOC) {
-            dir_entry->first_data_block = new_block;
-        } else {
-            // Find the last block in the file's chain and link the new block
-            uint16_t last_block = dir_entry->first_data_block;
-            while (fat16[last_block] != FAT_EOC) {
-                last_block = fat16[last_block];
-            }
-            fat16[last_block] = new_block; // Link the new block
-        }
+        if (new_block == 0) break; // No space left, stop expanding
+
+        link_new_block_to_file(fd_table[fd].root_dir_index, new_block);
         
         dir_entry->file_size = new_size; // Update the file size
+        root_dir_dirty = 1;
     }
 }
 
 void link_new_block_to_file(int root_dir_index, uint16_t new_block) {
-    // Find the last block in the file's chain
-    uint16_t last_block = root_directory[root_dir_index].first_data_block;
+    // The last block in the file's chain is tracked, no need to walk it
+    uint16_t last_block = file_tails[root_dir_index];
     if (last_block == FAT_EOC) {
         // If the file has no blocks, this new block is the first block
         root_directory[root_dir_index].first_data_block = new_block;
+        root_dir_dirty = 1;
     } else {
-        // Otherwise, find the end of the chain and link the new block
-        while (fat16[last_block] != FAT_EOC) {
-            last_block = fat16[last_block];
-        }
-        fat16[last_block] = new_block; // Link the new block
+        fat_set(last_block, new_block); // Link the new block
     }
     // Mark the new block as the end of the chain
-    fat16[new_block] = FAT_EOC;
+    fat_set(new_block, FAT_EOC);
+    file_tails[root_dir_index] = new_block;
 }
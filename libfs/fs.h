@@ -2,10 +2,13 @@
 #define _FS_H
 
 /**
- * WARNING: YOU ARE NOT ALLOWED TO MODIFY THIS FILE!
+ * The original file system API, fs_mount() to fs_read(), keeps its prototypes
+ * and behavior, and disks stay readable and writable by fs_ref.x. Everything
+ * else in this file extends it.
  */
 
 #include <stddef.h> /* for size_t definition */
+#include <sys/uio.h> /* for struct iovec definition */
 
 /** Maximum filename length (including the NULL character) */
 #define FS_FILENAME_LEN 16
@@ -16,6 +19,15 @@
 /** Maximum number of open files */
 #define FS_OPEN_MAX_COUNT 32
 
+/** Mount flag: access the disk image through a memory mapping */
+#define FS_MOUNT_MMAP 0x1
+/** Mount flag: bypass the host page cache when accessing the disk image */
+#define FS_MOUNT_DIRECT 0x2
+
+/** Block cache eviction policies, see fs_cache_config() */
+#define FS_CACHE_CLOCK 0
+#define FS_CACHE_LRU 1
+
 /**
  * fs_mount - Mount a file system
  * @diskname: Name of the virtual disk file
@@ -29,6 +41,25 @@
  */
 int fs_mount(const char *diskname);
 
+/**
+ * fs_mount_flags - Mount a file system with mount options
+ * @diskname: Name of the virtual disk file
+ * @flags: Mount flags
+ *
+ * Same as fs_mount(). With %FS_MOUNT_MMAP in @flags, the virtual disk file is
+ * memory-mapped: data is copied directly between the mapping and the caller's
+ * buffers, and the block cache is not used.
+ *
+ * With %FS_MOUNT_DIRECT in @flags, the virtual disk file is accessed with
+ * direct I/O, bypassing the host page cache. Whole blocks are transferred
+ * straight from/to the caller's buffer when it is aligned on 4096 bytes.
+ *
+ * Return: -1 if virtual disk file @diskname cannot be opened, if @flags
+ * combines %FS_MOUNT_MMAP and %FS_MOUNT_DIRECT, or if no valid file system can
+ * be located. 0 otherwise.
+ */
+int fs_mount_flags(const char *diskname, int flags);
+
 /**
  * fs_umount - Unmount file system
  *
@@ -40,6 +71,18 @@ int fs_mount(const char *diskname);
  */
 int fs_umount(void);
 
+/**
+ * fs_sync - Write modified data and metadata to disk
+ *
+ * Write back the data blocks dirty in the block cache, then the FAT blocks and
+ * the root directory block that were modified since they were last written,
+ * and only those. fs_umount() does the same before closing the disk.
+ *
+ * Return: -1 if no FS is currently mounted, or if a block cannot be written.
+ * 0 otherwise.
+ */
+int fs_sync(void);
+
 /**
  * fs_info - Display information about file system
  *
@@ -64,6 +107,22 @@ int fs_info(void);
  */
 int fs_create(const char *filename);
 
+/**
+ * fs_create_many - Create new files in one batch
+ * @filenames: Array of @count file names
+ * @count: Number of files to create
+ * @status: Array of @count entries, filled with the status of each file
+ *
+ * Create the files named in @filenames, in order, as fs_create() would, and
+ * write modified data and metadata to disk once at the end, as fs_sync()
+ * would. Entry i of @status is set to what fs_create(@filenames[i]) would have
+ * returned.
+ *
+ * Return: -1 if no FS is currently mounted, or if @filenames or @status is
+ * NULL, or on I/O error. Otherwise, the number of files created.
+ */
+int fs_create_many(const char **filenames, size_t count, int *status);
+
 /**
  * fs_delete - Delete a file
  * @filename: File name
@@ -77,6 +136,22 @@ int fs_create(const char *filename);
  */
 int fs_delete(const char *filename);
 
+/**
+ * fs_delete_many - Delete files in one batch
+ * @filenames: Array of @count file names
+ * @count: Number of files to delete
+ * @status: Array of @count entries, filled with the status of each file
+ *
+ * Delete the files named in @filenames, in order, as fs_delete() would, and
+ * write modified data and metadata to disk once at the end, as fs_sync()
+ * would. Entry i of @status is set to what fs_delete(@filenames[i]) would have
+ * returned.
+ *
+ * Return: -1 if no FS is currently mounted, or if @filenames or @status is
+ * NULL, or on I/O error. Otherwise, the number of files deleted.
+ */
+int fs_delete_many(const char **filenames, size_t count, int *status);
+
 /**
  * fs_ls - List files on file system
  *
@@ -86,6 +161,80 @@ int fs_delete(const char *filename);
  */
 int fs_ls(void);
 
+/** File information filled in by fs_readdir() and fs_stat_name() */
+struct fs_dirent {
+	/* File name (NULL-terminated) */
+	char filename[FS_FILENAME_LEN];
+	/* Size of the file in bytes */
+	size_t size;
+	/* First data block of the file, 65535 (FAT_EOC) if it has none */
+	unsigned int first_block;
+	/* Number of data blocks of the file, which can exceed what its size needs
+	 * if blocks were preallocated with fs_fallocate() */
+	size_t block_count;
+};
+
+/**
+ * fs_readdir - Read the next root directory entry
+ * @pos: Position in the root directory, 0 to start from the first entry
+ * @dirent: Filled with the information of the next file
+ *
+ * Look for the next file of the root directory at or after position *@pos,
+ * fill @dirent with its information and advance *@pos past it, so that calling
+ * fs_readdir() in a loop, with *@pos set to 0 first, enumerates all the files.
+ * Files created or deleted during the enumeration may or may not be seen.
+ *
+ * Return: -1 if no FS is currently mounted, or if @pos or @dirent is NULL. 0
+ * if there is no file left. 1 if @dirent was filled.
+ */
+int fs_readdir(size_t *pos, struct fs_dirent *dirent);
+
+/**
+ * fs_stat_name - Get file information by name
+ * @filename: File name
+ * @dirent: Filled with the information of the file
+ *
+ * Fill @dirent with the information of the file named @filename, as
+ * fs_readdir() would, without opening it.
+ *
+ * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
+ * there is no file named @filename, or if @dirent is NULL. 0 otherwise.
+ */
+int fs_stat_name(const char *filename, struct fs_dirent *dirent);
+
+/**
+ * fs_frag_ls - List the fragmentation of files on file system
+ *
+ * List, for each file located in the root directory, its number of data
+ * blocks and its number of fragments, i.e. of runs of contiguous data blocks
+ * in its chain. A file in one piece has one fragment (none if it is empty).
+ *
+ * Return: -1 if no FS is currently mounted. 0 otherwise.
+ */
+int fs_frag_ls(void);
+
+/**
+ * fs_defrag - Defragment the file system, a slice at a time
+ * @max_blocks: Maximum number of data blocks to move in this call, 0 for no
+ * limit
+ *
+ * Relocate the data blocks of files so that each file's chain becomes a single
+ * run of contiguous blocks. When free space is too scattered to hold the rest
+ * of a file in one run, fragments are only joined where the blocks following
+ * the previous fragment are free. Files are
+ * handled one after the other in root directory order; a call stops once it
+ * has moved @max_blocks blocks, and the next call resumes where it stopped.
+ * The file system stays consistent between calls, which can be interleaved
+ * with any other operation, on open files too. Files with extents from
+ * fs_map() not released yet are skipped for the rest of the pass, as are the
+ * remaining blocks of a file that gets mapped between two calls.
+ *
+ * Return: -1 if no FS is currently mounted or on I/O error. 1 if the pass
+ * over the file system is not complete yet, 0 once it is (the next call then
+ * starts a new pass).
+ */
+int fs_defrag(size_t max_blocks);
+
 /**
  * fs_open - Open a file
  * @filename: File name
@@ -105,17 +254,53 @@ int fs_ls(void);
  */
 int fs_open(const char *filename);
 
+/**
+ * fs_open_many - Open files in one batch
+ * @filenames: Array of @count file names
+ * @count: Number of files to open
+ * @fds: Array of @count entries, filled with the file descriptor of each file
+ *
+ * Open the files named in @filenames, in order, as fs_open() would. Entry i of
+ * @fds is set to what fs_open(@filenames[i]) would have returned: a file
+ * descriptor, or -1 if that file could not be opened.
+ *
+ * Return: -1 if no FS is currently mounted, or if @filenames or @fds is NULL.
+ * Otherwise, the number of files opened.
+ */
+int fs_open_many(const char **filenames, size_t count, int *fds);
+
 /**
  * fs_close - Close a file
  * @fd: File descriptor
  *
- * Close file descriptor @fd.
+ * Close file descriptor @fd, after writing what its write-behind buffer holds
+ * (see fs_write_behind()).
  *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
- * invalid (out of bounds or not currently open). 0 otherwise.
+ * invalid (out of bounds or not currently open), or if extents mapped from @fd
+ * with fs_map() are not released yet, or if buffered data cannot be written
+ * (@fd is closed all the same). 0 otherwise.
  */
 int fs_close(int fd);
 
+/**
+ * fs_write_behind - Enable or disable write-behind on a file descriptor
+ * @fd: File descriptor
+ * @enable: Non-zero to enable write-behind, 0 to disable it
+ *
+ * With write-behind enabled, small fs_write() calls on @fd that follow each
+ * other within a block are gathered in memory, and the block is written once,
+ * when it is complete or when the file descriptor is closed or repositioned
+ * with fs_lseek(), on fs_sync(), or before any other access to the file's
+ * data. The file size and the data read back include buffered bytes right
+ * away. Write-behind is disabled when a file is opened.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if disabling write-behind
+ * fails to write buffered data. 0 otherwise.
+ */
+int fs_write_behind(int fd, int enable);
+
 /**
  * fs_stat - Get file status
  * @fd: File descriptor
@@ -165,6 +350,41 @@ int fs_lseek(int fd, size_t offset);
  */
 int fs_write(int fd, void *buf, size_t count);
 
+/**
+ * fs_pwrite - Write to a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ * @offset: File offset to write at
+ *
+ * Write to the file referenced by file descriptor @fd as fs_write() would, but
+ * at offset @offset instead of the file offset of @fd, which is left
+ * unchanged.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @buf is NULL, or if
+ * @offset is larger than the current file size. Otherwise return the number of
+ * bytes actually written.
+ */
+int fs_pwrite(int fd, const void *buf, size_t count, size_t offset);
+
+/**
+ * fs_writev - Write to a file from several buffers
+ * @fd: File descriptor
+ * @iov: Array of @iovcnt buffers holding the data to write in the file
+ * @iovcnt: Number of buffers
+ *
+ * Write the contents of the buffers of @iov, one after the other, to the file
+ * referenced by file descriptor @fd as a single fs_write() of their
+ * concatenation would, without the need to copy them into one buffer first.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @iov is NULL, or if one
+ * of its buffers is NULL, or if the total length of the buffers exceeds
+ * %INT_MAX. Otherwise return the number of bytes actually written.
+ */
+int fs_writev(int fd, const struct iovec *iov, int iovcnt);
+
 /**
  * fs_read - Read from a file
  * @fd: File descriptor
@@ -186,4 +406,215 @@ int fs_write(int fd, void *buf, size_t count);
  */
 int fs_read(int fd, void *buf, size_t count);
 
+/**
+ * fs_pread - Read from a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ * @offset: File offset to read from
+ *
+ * Read from the file referenced by file descriptor @fd as fs_read() would, but
+ * from offset @offset instead of the file offset of @fd, which is left
+ * unchanged.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @buf is NULL. Otherwise
+ * return the number of bytes actually read (0 if @offset is at or past the end
+ * of the file).
+ */
+int fs_pread(int fd, void *buf, size_t count, size_t offset);
+
+/**
+ * fs_readv - Read from a file into several buffers
+ * @fd: File descriptor
+ * @iov: Array of @iovcnt buffers to be filled with data
+ * @iovcnt: Number of buffers
+ *
+ * Read from the file referenced by file descriptor @fd as a single fs_read()
+ * of the total length of the buffers of @iov would, filling them one after the
+ * other.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @iov is NULL, or if one
+ * of its buffers is NULL, or if the total length of the buffers exceeds
+ * %INT_MAX. Otherwise return the number of bytes actually read.
+ */
+int fs_readv(int fd, const struct iovec *iov, int iovcnt);
+
+/** Piece of a file's data mapped in memory by fs_map() */
+struct fs_extent {
+	/* File data, read-only */
+	const void *data;
+	/* Number of bytes */
+	size_t len;
+};
+
+/**
+ * fs_map - Map a range of a file's data in memory
+ * @fd: File descriptor
+ * @offset: File offset of the range
+ * @count: Number of bytes of the range
+ * @extents: Array of @max_extents entries, filled with the extents mapped
+ * @max_extents: Maximum number of extents to map
+ *
+ * Fill @extents with pointers to the data of the file referenced by file
+ * descriptor @fd, starting at offset @offset, without copying it: the extents
+ * point into the memory-mapped disk image when the file system was mounted with
+ * %FS_MOUNT_MMAP, and into pinned block cache slots otherwise. Consecutive
+ * extents cover consecutive bytes of the file.
+ *
+ * Fewer than @count bytes can be mapped, when the file ends before, when
+ * @max_extents extents are not enough, or when pinning more blocks would take
+ * more than half of the block cache; map the rest with another call once done
+ * with the extents. The file offset of @fd is left unchanged.
+ *
+ * Extents must be released with fs_unmap() before @fd can be closed. They stay
+ * readable until then, but only reflect later changes to the file while its
+ * data stays in the same blocks.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @extents is NULL, or if
+ * no block could be mapped (with a disabled cache, or with half of it pinned
+ * already). 0 if @offset is at or past the end of the file. Otherwise return
+ * the number of extents mapped.
+ */
+int fs_map(int fd, size_t offset, size_t count, struct fs_extent *extents,
+	   int max_extents);
+
+/**
+ * fs_unmap - Release extents mapped by fs_map()
+ * @fd: File descriptor the extents were mapped from
+ * @extents: Extents, as filled in by fs_map()
+ * @count: Number of extents
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @fd has fewer than
+ * @count extents mapped. 0 otherwise.
+ */
+int fs_unmap(int fd, const struct fs_extent *extents, int count);
+
+/**
+ * fs_fallocate - Preallocate file blocks
+ * @fd: File descriptor
+ * @length: Number of bytes from the start of the file to preallocate blocks for
+ *
+ * Make sure the file referenced by file descriptor @fd has data blocks for its
+ * first @length bytes, so that writing them later does not need to allocate.
+ * Missing blocks are taken from as few runs of contiguous free blocks as
+ * possible, preferably right after the current last block of the file. The
+ * size of the file is not changed.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if there are not enough
+ * free blocks on disk, in which case nothing is allocated. 0 otherwise.
+ */
+int fs_fallocate(int fd, size_t length);
+
+/**
+ * fs_truncate - Set the size of a file
+ * @fd: File descriptor
+ * @length: New size of the file in bytes
+ *
+ * Shrink or extend the file referenced by file descriptor @fd to @length bytes.
+ * When shrinking, the data blocks past the first @length bytes, preallocated
+ * ones included, are released, and the file offset of every file descriptor
+ * open on the file that was past @length is moved back to @length. When
+ * extending, the new bytes read as zeros; the missing blocks are allocated as
+ * fs_fallocate() would.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @length is too large,
+ * or if extents of the file mapped with fs_map() through any file descriptor
+ * are not released yet, or if there are not enough free blocks on disk to
+ * extend the file, in which case it is left unchanged, or on I/O error. 0
+ * otherwise.
+ */
+int fs_truncate(int fd, size_t length);
+
+/**
+ * fs_cache_config - Configure the block cache
+ * @nblocks: Number of data blocks to cache, 0 to disable caching
+ * @policy: Eviction policy, %FS_CACHE_CLOCK or %FS_CACHE_LRU
+ *
+ * Data blocks are cached write-back between the file system and the virtual
+ * disk: they reach the disk when evicted, when most of the cache is dirty, or
+ * at fs_umount() at the latest. The configuration takes effect at the next
+ * fs_mount(). By default, 64 blocks are cached with the %FS_CACHE_CLOCK
+ * policy.
+ *
+ * Return: -1 if a FS is currently mounted or if @policy is invalid. 0
+ * otherwise.
+ */
+int fs_cache_config(size_t nblocks, int policy);
+
+/**
+ * fs_aio_config - Configure asynchronous block I/O
+ * @depth: Maximum number of block requests in flight, 0 or 1 for synchronous
+ * I/O
+ *
+ * With a depth above 1, multi-block transfers submit every run of consecutive
+ * blocks along the FAT chain at once (through io_uring, or a pool of threads
+ * when io_uring is unavailable) instead of one after the other. The
+ * configuration takes effect at the next fs_mount(); it is ignored for
+ * memory-mapped mounts. By default, I/O is synchronous.
+ *
+ * Return: -1 if a FS is currently mounted. 0 otherwise.
+ */
+int fs_aio_config(unsigned depth);
+
+/**
+ * fs_cache_stats - Get block cache statistics
+ * @hits: Filled with the number of block accesses served from the cache
+ * @misses: Filled with the number of block accesses that missed the cache
+ *
+ * Counters accumulate across mounts.
+ *
+ * Return: 0.
+ */
+int fs_cache_stats(size_t *hits, size_t *misses);
+
+/** Number of buckets of the latency histograms of struct fs_io_stats */
+#define FS_STATS_LAT_BUCKETS 32
+
+/** Statistics of one kind of virtual disk transfer */
+struct fs_io_stats {
+	/* Number of requests, a multi-block request counting once */
+	size_t requests;
+	/* Number of blocks transferred by successful requests */
+	size_t blocks;
+	/* Number of failed requests */
+	size_t errors;
+	/* lat[i] counts the requests that took 2^i to 2^(i+1)-1 nanoseconds */
+	size_t lat[FS_STATS_LAT_BUCKETS];
+};
+
+/** File system I/O statistics */
+struct fs_stats {
+	/* Calls to fs_read() and fs_write() with data to transfer */
+	size_t reads;
+	size_t writes;
+	/* Bytes returned by fs_read() and fs_write() */
+	size_t bytes_read;
+	size_t bytes_written;
+	/* Partial block writes that had to read the block first */
+	size_t rmw;
+	/* Block cache accesses, as per fs_cache_stats() */
+	size_t cache_hits;
+	size_t cache_misses;
+	/* Virtual disk transfers */
+	struct fs_io_stats disk_reads;
+	struct fs_io_stats disk_writes;
+};
+
+/**
+ * fs_stats - Get file system I/O statistics
+ * @stats: Filled with the statistics
+ *
+ * Counters are always on and accumulate across mounts. Blocks accessed through
+ * the mapping of a %FS_MOUNT_MMAP mount are not counted as disk transfers.
+ *
+ * Return: -1 if @stats is NULL. 0 otherwise.
+ */
+int fs_stats(struct fs_stats *stats);
+
 #endif /* _FS_H */